@@ -0,0 +1,277 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bignum.h"
+
+static uint32_t* _big_alloc(int len) {
+    return len ? malloc(sizeof(uint32_t) * len) : NULL;
+}
+
+static void _big_trim(bignum* r) {
+    while (r->len > 0 && r->digits[r->len - 1] == 0) {
+        r->len--;
+    }
+    if (r->len == 0) {
+        r->neg = 0;
+    }
+}
+
+void big_from_long(bignum* r, long x) {
+    uint64_t m = x < 0 ? -(uint64_t)x : (uint64_t)x;
+    r->neg = x < 0;
+    r->len = 0;
+    r->digits = _big_alloc(2);
+    while (m) {
+        r->digits[r->len++] = (uint32_t)m;
+        m >>= 32;
+    }
+    _big_trim(r);
+}
+
+int big_from_string(bignum* r, char* s) {
+    int neg = *s == '-';
+    s += neg;
+    int n = strlen(s);
+    if (n == 0 || strspn(s, "0123456789") != (size_t)n) {
+        return 0;
+    }
+    /* Every 9 decimal digits fit in one base-2^32 digit. */
+    r->neg = neg;
+    r->len = 0;
+    r->digits = _big_alloc(n / 9 + 2);
+    for (; *s; ++s) {
+        uint64_t carry = *s - '0';
+        for (int i = 0; i < r->len; ++i) {
+            uint64_t cur = (uint64_t)r->digits[i] * 10 + carry;
+            r->digits[i] = (uint32_t)cur;
+            carry = cur >> 32;
+        }
+        if (carry) {
+            r->digits[r->len++] = (uint32_t)carry;
+        }
+    }
+    _big_trim(r);
+    return 1;
+}
+
+void big_copy(bignum* r, bignum* a) {
+    r->neg = a->neg;
+    r->len = a->len;
+    r->digits = _big_alloc(a->len);
+    memcpy(r->digits, a->digits, sizeof(uint32_t) * a->len);
+}
+
+void big_free(bignum* a) {
+    free(a->digits);
+    a->digits = NULL;
+    a->len = 0;
+}
+
+int big_to_long(bignum* a, long* out) {
+    if (a->len > 2) {
+        return 0;
+    }
+    uint64_t m = 0;
+    for (int i = a->len - 1; i >= 0; --i) {
+        m = (m << 32) | a->digits[i];
+    }
+    if (!a->neg) {
+        if (m > (uint64_t)LONG_MAX) {
+            return 0;
+        }
+        *out = (long)m;
+    } else {
+        if (m > (uint64_t)LONG_MAX + 1) {
+            return 0;
+        }
+        *out = m == (uint64_t)LONG_MAX + 1 ? LONG_MIN : -(long)m;
+    }
+    return 1;
+}
+
+double big_to_double(bignum* a) {
+    double r = 0;
+    for (int i = a->len - 1; i >= 0; --i) {
+        r = r * 4294967296.0 + a->digits[i];
+    }
+    return a->neg ? -r : r;
+}
+
+char* big_to_string(bignum* a) {
+    /* A base-2^32 digit has at most 10 decimal digits. */
+    int size = a->len * 10 + 3;
+    char* buf = malloc(size);
+    int pos = size - 1;
+    buf[pos] = '\0';
+    if (a->len == 0) {
+        buf[--pos] = '0';
+    }
+
+    int n = a->len;
+    uint32_t* t = _big_alloc(n);
+    memcpy(t, a->digits, sizeof(uint32_t) * n);
+    while (n > 0) {
+        uint64_t rem = 0;
+        for (int i = n - 1; i >= 0; --i) {
+            uint64_t cur = (rem << 32) | t[i];
+            t[i] = (uint32_t)(cur / 1000000000);
+            rem = cur % 1000000000;
+        }
+        while (n > 0 && t[n - 1] == 0) {
+            n--;
+        }
+        for (int k = 0; k < 9; ++k) {
+            buf[--pos] = '0' + rem % 10;
+            rem /= 10;
+            if (n == 0 && rem == 0) {
+                break;
+            }
+        }
+    }
+    free(t);
+
+    if (a->neg) {
+        buf[--pos] = '-';
+    }
+    memmove(buf, buf + pos, size - pos);
+    return buf;
+}
+
+static int _big_cmp_mag(bignum* a, bignum* b) {
+    if (a->len != b->len) {
+        return a->len < b->len ? -1 : 1;
+    }
+    for (int i = a->len - 1; i >= 0; --i) {
+        if (a->digits[i] != b->digits[i]) {
+            return a->digits[i] < b->digits[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+int big_cmp(bignum* a, bignum* b) {
+    if (a->neg != b->neg) {
+        return a->neg ? -1 : 1;
+    }
+    int c = _big_cmp_mag(a, b);
+    return a->neg ? -c : c;
+}
+
+/* r = |a| + |b|, with room for the carry. */
+static void _big_add_mag(bignum* r, bignum* a, bignum* b) {
+    if (a->len < b->len) {
+        bignum* t = a;
+        a = b;
+        b = t;
+    }
+    r->len = a->len + 1;
+    r->digits = _big_alloc(r->len);
+    uint64_t carry = 0;
+    for (int i = 0; i < a->len; ++i) {
+        carry += a->digits[i];
+        if (i < b->len) {
+            carry += b->digits[i];
+        }
+        r->digits[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    r->digits[a->len] = (uint32_t)carry;
+}
+
+/* a -= b on digit arrays, where a >= b and alen >= blen. */
+static void _big_sub_digits(uint32_t* a, int alen, uint32_t* b, int blen) {
+    int64_t borrow = 0;
+    for (int i = 0; i < alen; ++i) {
+        int64_t cur = (int64_t)a[i] - (i < blen ? b[i] : 0) - borrow;
+        borrow = cur < 0;
+        a[i] = (uint32_t)(cur + (borrow << 32));
+    }
+    assert( borrow == 0 );
+}
+
+/* r = |a| - |b|, where |a| >= |b|. */
+static void _big_sub_mag(bignum* r, bignum* a, bignum* b) {
+    r->len = a->len;
+    r->digits = _big_alloc(a->len);
+    memcpy(r->digits, a->digits, sizeof(uint32_t) * a->len);
+    _big_sub_digits(r->digits, r->len, b->digits, b->len);
+}
+
+void big_add(bignum* r, bignum* a, bignum* b) {
+    if (a->neg == b->neg) {
+        _big_add_mag(r, a, b);
+        r->neg = a->neg;
+    } else if (_big_cmp_mag(a, b) >= 0) {
+        _big_sub_mag(r, a, b);
+        r->neg = a->neg;
+    } else {
+        _big_sub_mag(r, b, a);
+        r->neg = b->neg;
+    }
+    _big_trim(r);
+}
+
+void big_sub(bignum* r, bignum* a, bignum* b) {
+    bignum neg_b = *b;
+    neg_b.neg = b->len > 0 && !b->neg;
+    big_add(r, a, &neg_b);
+}
+
+void big_mul(bignum* r, bignum* a, bignum* b) {
+    r->neg = a->neg != b->neg;
+    r->len = a->len + b->len;
+    r->digits = calloc(r->len ? r->len : 1, sizeof(uint32_t));
+    for (int i = 0; i < a->len; ++i) {
+        uint64_t carry = 0;
+        for (int j = 0; j < b->len; ++j) {
+            uint64_t cur = (uint64_t)a->digits[i] * b->digits[j] +
+                r->digits[i + j] + carry;
+            r->digits[i + j] = (uint32_t)cur;
+            carry = cur >> 32;
+        }
+        r->digits[i + b->len] = (uint32_t)carry;
+    }
+    _big_trim(r);
+}
+
+void big_div(bignum* r, bignum* a, bignum* b) {
+    assert( b->len > 0 );
+    r->neg = a->neg != b->neg;
+    r->len = a->len;
+    r->digits = calloc(a->len ? a->len : 1, sizeof(uint32_t));
+
+    if (b->len == 1) {
+        uint64_t rem = 0;
+        for (int i = a->len - 1; i >= 0; --i) {
+            uint64_t cur = (rem << 32) | a->digits[i];
+            r->digits[i] = (uint32_t)(cur / b->digits[0]);
+            rem = cur % b->digits[0];
+        }
+        _big_trim(r);
+        return;
+    }
+
+    /* Binary long division. The remainder stays below b, so shifting
+     * it left by one bit needs at most one extra digit. */
+    bignum rem = { 0, 0, _big_alloc(b->len + 1) };
+    for (int bit = a->len * 32 - 1; bit >= 0; --bit) {
+        uint32_t carry = (a->digits[bit / 32] >> (bit % 32)) & 1;
+        for (int i = 0; i < rem.len; ++i) {
+            uint32_t next = rem.digits[i] >> 31;
+            rem.digits[i] = (rem.digits[i] << 1) | carry;
+            carry = next;
+        }
+        if (carry) {
+            rem.digits[rem.len++] = carry;
+        }
+        if (_big_cmp_mag(&rem, b) >= 0) {
+            _big_sub_digits(rem.digits, rem.len, b->digits, b->len);
+            _big_trim(&rem);
+            r->digits[bit / 32] |= (uint32_t)1 << (bit % 32);
+        }
+    }
+    big_free(&rem);
+    _big_trim(r);
+}
@@ -0,0 +1,41 @@
+#ifndef BIGNUM_H
+#define BIGNUM_H
+
+#include <stdint.h>
+
+/* Arbitrary-precision integers in sign-magnitude form. `digits` holds
+ * `len` base-2^32 digits, least significant first, with no leading
+ * zero digits; zero has len 0 and is never negative.
+ *
+ * Every function that produces a bignum writes it to an uninitialized
+ * r, which must not alias an operand, and the caller releases it with
+ * big_free. */
+typedef struct {
+    int neg;
+    int len;
+    uint32_t* digits;
+} bignum;
+
+void big_from_long(bignum* r, long x);
+/* Parses an optionally negative decimal integer; returns 0 if s is not
+ * one. */
+int big_from_string(bignum* r, char* s);
+void big_copy(bignum* r, bignum* a);
+void big_free(bignum* a);
+
+/* Stores a in *out and returns 1 if it fits in a long. */
+int big_to_long(bignum* a, long* out);
+/* Returns the nearest double to a, or an infinity. */
+double big_to_double(bignum* a);
+/* Returns a malloc'd decimal representation of a. */
+char* big_to_string(bignum* a);
+
+int big_cmp(bignum* a, bignum* b);
+
+void big_add(bignum* r, bignum* a, bignum* b);
+void big_sub(bignum* r, bignum* a, bignum* b);
+void big_mul(bignum* r, bignum* a, bignum* b);
+/* Quotient rounded toward zero, like C's `/`. b must not be zero. */
+void big_div(bignum* r, bignum* a, bignum* b);
+
+#endif
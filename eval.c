@@ -4,15 +4,24 @@
 #include <string.h>
 
 #include "eval.h"
+#include "hcons.h"
+#include "heap.h"
 #include "lval.h"
 #include "parser.h"
 
 lval* _lval_pop(lval* v, int i) {
+    assert( v->rc == 1 && !v->base &&
+            !(v->flags & (LVAL_VEC | LVAL_HCONS)) );
     lval* ret = v->cell[i];
     memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count - i - 1));
 
     v->count--;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    if (v->cap > LVAL_INLINE_CELLS && v->count < v->cap / 4) {
+        int cap = v->cap / 2;
+        v->cell = heap_realloc(HEAP_ARRAY, v->cell, sizeof(lval*) * v->cap,
+                               sizeof(lval*) * cap);
+        v->cap = cap;
+    }
     return ret;
 }
 
@@ -46,94 +55,158 @@ lval* _lval_take(lval* v, int i) {
 
 lval* _op_head(lenv* e, lval* v) {
     LASSERT_NUM(v, 1, "head");
-    LASSERT_TYPE(v, v->cell[0]->type, LVAL_QEXPR, "head");
+    LASSERT_TYPE(v, lval_type(v->cell[0]), LVAL_QEXPR, "head");
     LASSERT(v, v->cell[0]->count > 0, "head: empty list!");
-    lval* ret= _lval_take(v, 0);
-    while(ret->count > 1) {
-        _lval_popd(ret, 1);
-    }
-    return ret;
+    return lval_slice(_lval_take(v, 0), 0, 1);
 }
 
 lval* _op_tail(lenv* e, lval* v) {
     LASSERT_NUM(v, 1, "tail");
-    LASSERT_TYPE(v, v->cell[0]->type, LVAL_QEXPR, "tail");
+    LASSERT_TYPE(v, lval_type(v->cell[0]), LVAL_QEXPR, "tail");
     LASSERT(v, v->cell[0]->count > 0, "tail: empty list!");
 
     lval* ret = _lval_take(v, 0);
-    _lval_popd(ret, 0);
-    return ret;
+    return lval_slice(ret, 1, ret->count - 1);
 }
 
 lval* _op_list(lenv* e, lval* v) {
-    v->type = LVAL_QEXPR;
+    v = lval_unshare(v);
+    lval_retype(v, LVAL_QEXPR);
     return v;
 }
 
 lval* _op_eval(lenv* e, lval* v) {
     LASSERT_NUM(v, 1, "eval");
-    LASSERT_TYPE(v, v->cell[0]->type, LVAL_QEXPR, "eval");
+    LASSERT_TYPE(v, lval_type(v->cell[0]), LVAL_QEXPR, "eval");
 
-    lval* x = _lval_take(v, 0);
-    x->type = LVAL_SEXPR;
+    lval* x = lval_unshare(_lval_take(v, 0));
+    lval_retype(x, LVAL_SEXPR);
     return lval_eval(e, x);
 }
 
 lval* _op_join(lenv* e, lval* v) {
     for(int i = 0; i < v->count; ++i) {
-        LASSERT_TYPE(v, v->cell[0]->type, LVAL_QEXPR, "join");
+        LASSERT_TYPE(v, lval_type(v->cell[i]), LVAL_QEXPR, "join");
     }
     lval* ret = lval_qexpr();
     while(v->count > 0) {
-        lval* x = _lval_pop(v, 0);
-        while(x->count > 0) {
-            lval_add(ret, _lval_pop(x, 0));
-        }
-        lval_del(x);
+        ret = lval_concat(ret, _lval_pop(v, 0));
     }
     lval_del(v);
     return ret;
 }
 
+/* Stores x as a bignum in *tmp, or returns x's own bignum if it is
+ * boxed. The caller frees *tmp if it was used. */
+static bignum* _lval_big_of(lval* x, bignum* tmp) {
+    if (!lval_is_fixnum(x)) {
+        return &x->big;
+    }
+    big_from_long(tmp, lval_num_value(x));
+    return tmp;
+}
+
+static int _lval_is_number(lval* v) {
+    return lval_type(v) == LVAL_NUM || lval_type(v) == LVAL_FLT;
+}
+
+static double _lval_double(lval* x) {
+    if (lval_is_fixnum(x)) {
+        return lval_num_value(x);
+    }
+    return x->type == LVAL_FLT ? x->flt : big_to_double(&x->big);
+}
+
+/* Applies op to two numbers, consuming x and borrowing y. If either is
+ * a float the result is one, and an unshared float x is reused for
+ * it. An integer y is non-zero for `/`. */
+static lval* _lval_arith(char op, lval* x, lval* y) {
+    if (lval_is_fixnum(x) && lval_is_fixnum(y)) {
+        long a = lval_num_value(x);
+        long b = lval_num_value(y);
+        long r;
+        int overflow = 0;
+        switch (op) {
+        case '+': overflow = __builtin_add_overflow(a, b, &r); break;
+        case '-': overflow = __builtin_sub_overflow(a, b, &r); break;
+        case '*': overflow = __builtin_mul_overflow(a, b, &r); break;
+        case '/': r = a / b; break;
+        default: assert( 0 );
+        }
+        if (!overflow) {
+            return lval_num(r);
+        }
+    }
+
+    if (lval_type(x) == LVAL_FLT || lval_type(y) == LVAL_FLT) {
+        double a = _lval_double(x);
+        double b = _lval_double(y);
+        double r;
+        switch (op) {
+        case '+': r = a + b; break;
+        case '-': r = a - b; break;
+        case '*': r = a * b; break;
+        case '/': r = a / b; break;
+        default: assert( 0 );
+        }
+        if (lval_type(x) == LVAL_FLT && x->rc == 1) {
+            x->flt = r;
+            return x;
+        }
+        lval_del(x);
+        return lval_flt(r);
+    }
+
+    bignum tx, ty, r;
+    bignum* a = _lval_big_of(x, &tx);
+    bignum* b = _lval_big_of(y, &ty);
+    switch (op) {
+    case '+': big_add(&r, a, b); break;
+    case '-': big_sub(&r, a, b); break;
+    case '*': big_mul(&r, a, b); break;
+    case '/': big_div(&r, a, b); break;
+    default: assert( 0 );
+    }
+    if (a == &tx) {
+        big_free(&tx);
+    }
+    if (b == &ty) {
+        big_free(&ty);
+    }
+    lval_del(x);
+    return lval_num_big(&r);
+}
+
 lval* _op_arith(lenv* e, lval* v, char* op) {
     for(int i = 0; i < v->count; ++i) {
-        LASSERT_TYPE(v, v->cell[i]->type, LVAL_NUM, "operator");
+        LASSERT(v, _lval_is_number(v->cell[i]),
+                "operator: expected Number got %s!",
+                lval_type_name(lval_type(v->cell[i])));
     }
     LASSERT(v, (v->count > 0 || (strcmp(op, "-") != 0 && strcmp(op, "/") != 0)),
             "Operator (%s): wrong arity", op);
 
-    lval* x =  _lval_pop(v, 0);
+    lval* acc =  _lval_pop(v, 0);
 
-    if (strcmp(op, "-") == 0 && v->count == 0) {
-        x->num = -x->num;
+    if (op[0] == '-' && v->count == 0) {
+        lval* x = acc;
+        acc = _lval_arith('-', lval_num(0), x);
+        lval_del(x);
     }
 
     while (v->count > 0) {
         lval* y = _lval_pop(v, 0);
-        if (strcmp(op, "+") == 0)
-            x->num += y->num;
-
-        else if (strcmp(op, "-") == 0)
-            x->num -= y->num;
-
-        else if (strcmp(op, "*") == 0)
-            x->num *= y->num;
-
-        else if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                lval_del(v);
-                return lval_err("Division by zero!");
-            }
-            x->num /= y->num;
-        } else {
-            assert( 0 );
+        if (op[0] == '/' && lval_is_fixnum(y) && lval_num_value(y) == 0) {
+            lval_del(y);
+            lval_del(acc);
+            lval_del(v);
+            return lval_err("Division by zero!");
         }
+        acc = _lval_arith(op[0], acc, y);
         lval_del(y);
     }
     lval_del(v);
-    return x;
+    return acc;
 }
 
 lval* _op_add(lenv* e, lval* v) { return _op_arith(e, v, "+"); }
@@ -141,25 +214,51 @@ lval* _op_sub(lenv* e, lval* v) { return _op_arith(e, v, "-"); }
 lval* _op_mul(lenv* e, lval* v) { return _op_arith(e, v, "*"); }
 lval* _op_div(lenv* e, lval* v) { return _op_arith(e, v, "/"); }
 
+static int _lval_num_cmp(lval* x, lval* y) {
+    if (lval_is_fixnum(x) && lval_is_fixnum(y)) {
+        long a = lval_num_value(x);
+        long b = lval_num_value(y);
+        return (a > b) - (a < b);
+    }
+    if (lval_type(x) == LVAL_FLT || lval_type(y) == LVAL_FLT) {
+        double a = _lval_double(x);
+        double b = _lval_double(y);
+        return (a > b) - (a < b);
+    }
+    bignum tx, ty;
+    bignum* a = _lval_big_of(x, &tx);
+    bignum* b = _lval_big_of(y, &ty);
+    int c = big_cmp(a, b);
+    if (a == &tx) {
+        big_free(&tx);
+    }
+    if (b == &ty) {
+        big_free(&ty);
+    }
+    return c;
+}
+
 lval* _op_cmp(lenv* e, lval* v, char* op) {
     LASSERT_NUM(v, 2, "comparison");
-    LASSERT_TYPE(v, v->cell[0]->type, LVAL_NUM, "comparison");
-    LASSERT_TYPE(v, v->cell[1]->type, LVAL_NUM, "comparison");
-    int x = v->cell[0]->num;
-    int y = v->cell[1]->num;
+    for (int i = 0; i < 2; ++i) {
+        LASSERT(v, _lval_is_number(v->cell[i]),
+                "comparison: expected Number got %s!",
+                lval_type_name(lval_type(v->cell[i])));
+    }
+    int c = _lval_num_cmp(v->cell[0], v->cell[1]);
     lval_del(v);
     int r;
     if (strcmp(op, "<") == 0) {
-        r = x < y;
+        r = c < 0;
     }
     if (strcmp(op, "<=") == 0) {
-        r = x <= y;
+        r = c <= 0;
     }
     if (strcmp(op, ">") == 0) {
-        r = x > y;
+        r = c > 0;
     }
     if (strcmp(op, ">=") == 0) {
-        r = x >= y;
+        r = c >= 0;
     }
 
     return lval_num(r);
@@ -171,34 +270,44 @@ lval* _op_gt(lenv* e, lval* v) { return _op_cmp(e, v, ">"); }
 lval* _op_ge(lenv* e, lval* v) { return _op_cmp(e, v, ">="); }
 
 int _lval_equals(lval* a, lval* b) {
-    if (a->type != b->type) {
+    if (lval_type(a) != lval_type(b)) {
         return 0;
     }
-    switch (a->type) {
+    switch (lval_type(a)) {
     case LVAL_ERR:
-        return strcmp(a->err, b->err) == 0;
+        {
+            char x[512];
+            char y[512];
+            lval_err_message(a, x, sizeof(x));
+            lval_err_message(b, y, sizeof(y));
+            return strcmp(x, y) == 0;
+        }
     case LVAL_FUN:
-        if (a->builtin || b->builtin) {
-            return a->builtin == b->builtin;
+        if (lval_is_builtin(a) || lval_is_builtin(b)) {
+            return lval_is_builtin(a) && lval_is_builtin(b) &&
+                a->builtin == b->builtin;
         }
         return _lval_equals(a->formals, b->formals) &&  \
             _lval_equals(a->body, b->body);
+    case LVAL_FLT:
+        return a->flt == b->flt;
     case LVAL_NUM:
-        return a->num == b->num;
+        return _lval_num_cmp(a, b) == 0;
     case LVAL_QEXPR:
     case LVAL_SEXPR:
         if (a->count != b->count) {
             return 0;
         }
-        int ret = 1;
         for (int i = 0; i < a->count; ++i) {
-            ret |= _lval_equals(a->cell[i], b->cell[i]);
+            if (!_lval_equals(lval_item(a, i), lval_item(b, i))) {
+                return 0;
+            }
         }
-        return ret;
+        return 1;
     case LVAL_STR:
-        return strcmp(a->str, b->str);
+        return a->len == b->len && memcmp(a->str, b->str, a->len) == 0;
     case LVAL_SYM:
-        return strcmp(a->sym, b->sym) == 0;
+        return a->sym == b->sym;
     default:
         assert( 0 );
     }
@@ -218,11 +327,15 @@ lval* _op_neq(lenv* e, lval* v) { return _lval_op_equality(e, v, "/="); }
 
 lval* _op_if(lenv* e, lval* v) {
     LASSERT_NUM(v, 3, "if");
-    LASSERT_TYPE(v, v->cell[0]->type, LVAL_NUM, "if");
-    LASSERT_TYPE(v, v->cell[1]->type, LVAL_QEXPR, "if");
-    LASSERT_TYPE(v, v->cell[2]->type, LVAL_QEXPR, "if");
+    LASSERT(v, _lval_is_number(v->cell[0]),
+            "if: expected Number got %s!",
+            lval_type_name(lval_type(v->cell[0])));
+    LASSERT_TYPE(v, lval_type(v->cell[1]), LVAL_QEXPR, "if");
+    LASSERT_TYPE(v, lval_type(v->cell[2]), LVAL_QEXPR, "if");
+    /* Any number other than zero, integer or float, is true. */
     lval* cond_val = _lval_pop(v, 0);
-    int cond = cond_val->num;
+    int cond = lval_type(cond_val) == LVAL_FLT ? cond_val->flt != 0 :
+        !lval_is_fixnum(cond_val) || lval_num_value(cond_val) != 0;
     lval_del(cond_val);
     lval* a = _lval_pop(v, 0);
     lval* b = _lval_take(v, 0);
@@ -232,24 +345,25 @@ lval* _op_if(lenv* e, lval* v) {
         b = t;
     }
     lval_del(b);
-    a->type = LVAL_SEXPR;
+    a = lval_unshare(a);
+    lval_retype(a, LVAL_SEXPR);
     return lval_eval(e, a);
 }
 
 lval* _op_definition(lenv* e, lval* v, char* op) {
-    LASSERT_TYPE(v, v->cell[0]->type, LVAL_QEXPR, "def");
+    LASSERT_TYPE(v, lval_type(v->cell[0]), LVAL_QEXPR, "def");
     lval* syms = v->cell[0];
     for (int i = 0; i < syms->count; ++i) {
-        LASSERT_TYPE(v, syms->cell[i]->type, LVAL_SYM, "def");
+        LASSERT_TYPE(v, lval_type(lval_item(syms, i)), LVAL_SYM, "def");
     }
     LASSERT_NUM(v, syms->count + 1, "def");
 
     for (int i = 0; i < syms->count; ++i) {
         if (strcmp(op, "def") == 0) {
-            lenv_def(e, syms->cell[i], v->cell[i + 1]);
+            lenv_def(e, lval_item(syms, i), v->cell[i + 1]);
         } else {
             assert( strcmp(op, ":=") == 0 );
-            lenv_put(e, syms->cell[i], v->cell[i + 1]);
+            lenv_put(e, lval_item(syms, i), v->cell[i + 1]);
         }
     }
     lval_del(v);
@@ -261,14 +375,14 @@ lval* _op_assign(lenv* e, lval* v) { return _op_definition(e, v, ":="); }
 
 lval* _op_lambda(lenv* e, lval* v) {
     LASSERT_NUM(v, 2, "\\");
-    LASSERT_TYPE(v, v->cell[0]->type, LVAL_QEXPR, "\\");
-    LASSERT_TYPE(v, v->cell[1]->type, LVAL_QEXPR, "\\");
+    LASSERT_TYPE(v, lval_type(v->cell[0]), LVAL_QEXPR, "\\");
+    LASSERT_TYPE(v, lval_type(v->cell[1]), LVAL_QEXPR, "\\");
     for (int i = 0; i < v->cell[0]->count; ++i) {
-        LASSERT_TYPE(v, v->cell[0]->cell[i]->type, LVAL_SYM, "\\");
+        LASSERT_TYPE(v, lval_type(lval_item(v->cell[0], i)), LVAL_SYM, "\\");
     }
 
-    lval* formals = _lval_pop(v, 0);
-    lval* body = _lval_take(v, 0);
+    lval* formals = hcons_intern(_lval_pop(v, 0));
+    lval* body = hcons_intern(_lval_take(v, 0));
 
     lval* ret = lval_lambda(formals, body);
 
@@ -285,24 +399,39 @@ lval* _op_print(lenv* e, lval* v) {
     return lval_sexpr();
 }
 
-lval* _op_error(lenv* e, lval* v) {
-    LASSERT_NUM(v, 1, "error");
-    LASSERT_TYPE(v, v->cell[0]->type, LVAL_STR, "error");
-    lval* ret = lval_err(v->cell[0]->str);
+lval* _op_show(lenv* e, lval* v) {
+    LASSERT_NUM(v, 1, "show");
+    lval* ret = lval_show(v->cell[0]);
     lval_del(v);
     return ret;
 }
 
+/* Called as `(heap-stats ())`; the argument is ignored. Returns the
+ * lval counters as a Q-expression, see lval_stats_list. */
+lval* _op_heap_stats(lenv* e, lval* v) {
+    lval_del(v);
+    return lval_stats_list();
+}
+
+lval* _op_error(lenv* e, lval* v) {
+    LASSERT_NUM(v, 1, "error");
+    LASSERT_TYPE(v, lval_type(v->cell[0]), LVAL_STR, "error");
+    return lval_err_str(_lval_take(v, 0));
+}
+
 lval* op_load(lenv* e, lval* v) {
     LASSERT_NUM(v, 1, "load");
-    LASSERT_TYPE(v, v->cell[0]->type, LVAL_STR, "load");
+    LASSERT_TYPE(v, lval_type(v->cell[0]), LVAL_STR, "load");
 
+    init_parser();
     mpc_result_t r;
     if (!mpc_parse_contents(v->cell[0]->str, Lispy, &r)) {
         char* err_msg = mpc_err_string(r.error);
         mpc_err_delete(r.error);
-        lval* err = lval_err("load: failed to load \"%s\": %s",
-                             v->cell[0]->str, err_msg);
+        char msg[512];
+        snprintf(msg, sizeof(msg), "load: failed to load \"%s\": %s",
+                 v->cell[0]->str, err_msg);
+        lval* err = lval_err_str(lval_str(msg));
         free(err_msg);
         lval_del(v);
         return err;
@@ -310,11 +439,13 @@ lval* op_load(lenv* e, lval* v) {
         lval* expr = lval_read(r.output);
         mpc_ast_delete(r.output);
         while (expr->count) {
+            lval_arena_begin();
             lval* x = lval_eval(e, _lval_pop(expr, 0));
-            if (x->type == LVAL_ERR) {
+            if (lval_type(x) == LVAL_ERR) {
                 lval_println(x);
             }
             lval_del(x);
+            lval_arena_end();
         }
         lval_del(expr);
         lval_del(v);
@@ -361,30 +492,40 @@ void lenv_add_builtins(lenv* e) {
     lenv_add_builtin(e, &op_load, "load");
 
     lenv_add_builtin(e, &_op_print, "print");
+    lenv_add_builtin(e, &_op_show, "show");
     lenv_add_builtin(e, &_op_error, "error");
+    lenv_add_builtin(e, &_op_heap_stats, "heap-stats");
 }
 
 lval* _lval_call(lenv* e, lval* f, lval* v) {
-    if (f->builtin) {
-        return f->builtin(e, v);
+    if (lval_is_builtin(f)) {
+        lval* ret = f->builtin(e, v);
+        lval_del(f);
+        return ret;
     }
 
+    f = lval_unshare(f);
+    f->formals = lval_unshare(f->formals);
     int n_formals = f->formals->count;
     int n_actual = v->count;
     while (v->count) {
         if (!f->formals->count) {
+            lval_del(f);
             lval_del(v);
             return lval_err("Too many arguments, expected %i, got %i!",
                             n_formals, n_actual);
         }
         lval* formal = _lval_pop(f->formals, 0);
         if (strcmp(formal->sym, "&") == 0) {
+            lval_del(formal);
             if (f->formals->count != 1) {
+                lval_del(f);
                 lval_del(v);
                 return lval_err("Bad varargs!");
             }
             lval* v_formal = _lval_pop(f->formals, 0);
-            lenv_put(e, v_formal, _op_list(e, v));
+            lenv_put(f->env, v_formal, _op_list(e, v));
+            lval_del(v_formal);
             break;
         }
         lval* actual = _lval_pop(v, 0);
@@ -395,28 +536,33 @@ lval* _lval_call(lenv* e, lval* f, lval* v) {
     lval_del(v);
     if (f->formals->count == 0) {
         f->env->parent = e;
-        f->body->type = LVAL_SEXPR;
-        return lval_eval(f->env, lval_copy(f->body));
+        lval* body = lval_unshare(lval_copy(f->body));
+        lval_retype(body, LVAL_SEXPR);
+        lval* ret = lval_eval(f->env, body);
+        lval_del(f);
+        return ret;
     }
     if (strcmp(f->formals->cell[0]->sym, "&") == 0) {
         if (f->formals->count != 2) {
+            lval_del(f);
             return lval_err("Bad varargs");
         }
         _lval_popd(f->formals, 0);
         lval* v_formal = _lval_pop(f->formals, 0);
         lval* v_actual = lval_qexpr();
-        lenv_put(e, v_formal, v_actual);
+        lenv_put(f->env, v_formal, v_actual);
         lval_del(v_formal);
         lval_del(v_actual);
     }
-    return lval_copy(f);
+    return f;
 }
 
 lval* _lval_eval_sexp(lenv* e, lval* v) {
-    assert( v->type == LVAL_SEXPR );
+    assert( lval_type(v) == LVAL_SEXPR );
+    v = lval_unshare(v);
     for(int i = 0; i < v->count; ++i) {
         v->cell[i] = lval_eval(e, v->cell[i]);
-        if ( v->cell[i]->type == LVAL_ERR) {
+        if ( lval_type(v->cell[i]) == LVAL_ERR) {
             return _lval_take(v, i);
         }
     }
@@ -430,25 +576,23 @@ lval* _lval_eval_sexp(lenv* e, lval* v) {
     }
 
     lval* f = _lval_pop(v, 0);
-    if(f->type != LVAL_FUN) {
+    if(lval_type(f) != LVAL_FUN) {
         lval* ret = lval_err("First element is not a function (%s)!",
-                             lval_type_name(f->type));
+                             lval_type_name(lval_type(f)));
         lval_del(f);
         lval_del(v);
         return ret;
     }
 
-    lval* ret = _lval_call(e, f, v);
-    lval_del(f);
-    return ret;
+    return _lval_call(e, f, v);
 }
 
 lval* lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYM) {
+    if (lval_type(v) == LVAL_SYM) {
         lval* ret = lenv_get(e, v);
         lval_del(v);
         return ret;
     }
-    lval* ret = v->type == LVAL_SEXPR ? _lval_eval_sexp(e, v) : v;
+    lval* ret = lval_type(v) == LVAL_SEXPR ? _lval_eval_sexp(e, v) : v;
     return ret;
 }
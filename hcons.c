@@ -0,0 +1,198 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hcons.h"
+
+static struct {
+    int count;
+    int used;
+    int capacity;
+    lval** slots;
+} hcons;
+
+/* Marks a slot whose list was forgotten, so that probing continues
+ * past it. */
+static lval _hcons_tombstone;
+
+static uint32_t _hcons_mix(uint32_t h, uint64_t x) {
+    for (int i = 0; i < 8; ++i) {
+        h = (h ^ (unsigned char)(x >> (8 * i))) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t _hcons_mix_bytes(uint32_t h, const void* p, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ ((const unsigned char*)p)[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int _hcons_is_list(lval* x) {
+    return !lval_is_fixnum(x) &&
+        (x->type == LVAL_QEXPR || x->type == LVAL_SEXPR);
+}
+
+static int _hcons_can_hold(lval* x) {
+    if (!lval_is_fixnum(x) && (x->flags & LVAL_ARENA)) {
+        return 0;
+    }
+    switch (lval_type(x)) {
+    case LVAL_FLT:
+    case LVAL_NUM:
+    case LVAL_STR:
+    case LVAL_SYM:
+        return 1;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+        return (x->flags & LVAL_HCONS) != 0;
+    default:
+        return 0;
+    }
+}
+
+/* Lists are hashed by the identity of their interned children and
+ * the value of their atoms. A symbol's slot hint is part of its value. */
+static uint32_t _hcons_hash_item(uint32_t h, lval* x) {
+    if (lval_is_fixnum(x) || _hcons_is_list(x)) {
+        return _hcons_mix(h, (uintptr_t)x);
+    }
+    h = _hcons_mix(h, x->type);
+    switch (x->type) {
+    case LVAL_FLT:
+        return _hcons_mix_bytes(h, &x->flt, sizeof(x->flt));
+    case LVAL_NUM:
+        h = _hcons_mix(h, x->big.neg);
+        return _hcons_mix_bytes(h, x->big.digits,
+                                sizeof(uint32_t) * x->big.len);
+    case LVAL_STR:
+        return _hcons_mix_bytes(h, x->str, x->len);
+    default:
+        h = _hcons_mix(h, x->slot);
+        return _hcons_mix(h, (uintptr_t)x->sym);
+    }
+}
+
+static uint32_t _hcons_hash(lval* v) {
+    uint32_t h = _hcons_mix(2166136261u, v->type);
+    h = _hcons_mix(h, v->count);
+    for (int i = 0; i < v->count; ++i) {
+        h = _hcons_hash_item(h, v->cell[i]);
+    }
+    return h;
+}
+
+static int _hcons_item_equals(lval* a, lval* b) {
+    if (a == b) {
+        return 1;
+    }
+    if (lval_is_fixnum(a) || lval_is_fixnum(b) || a->type != b->type) {
+        return 0;
+    }
+    switch (a->type) {
+    case LVAL_FLT:
+        return memcmp(&a->flt, &b->flt, sizeof(a->flt)) == 0;
+    case LVAL_NUM:
+        return big_cmp(&a->big, &b->big) == 0;
+    case LVAL_STR:
+        return a->len == b->len && memcmp(a->str, b->str, a->len) == 0;
+    case LVAL_SYM:
+        return a->sym == b->sym && a->slot == b->slot;
+    default:
+        return 0;
+    }
+}
+
+static int _hcons_equals(lval* a, lval* b) {
+    if (a->type != b->type || a->count != b->count) {
+        return 0;
+    }
+    for (int i = 0; i < a->count; ++i) {
+        if (!_hcons_item_equals(a->cell[i], b->cell[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void _hcons_grow(void) {
+    int capacity = hcons.capacity ? hcons.capacity : 256;
+    while (4 * (hcons.count + 1) > capacity) {
+        capacity *= 2;
+    }
+    lval** slots = calloc(capacity, sizeof(lval*));
+    for (int i = 0; i < hcons.capacity; ++i) {
+        lval* v = hcons.slots[i];
+        if (v && v != &_hcons_tombstone) {
+            uint32_t j = _hcons_hash(v) & (capacity - 1);
+            while (slots[j]) {
+                j = (j + 1) & (capacity - 1);
+            }
+            slots[j] = v;
+        }
+    }
+    free(hcons.slots);
+    hcons.slots = slots;
+    hcons.capacity = capacity;
+    hcons.used = hcons.count;
+}
+
+lval* hcons_intern(lval* v) {
+    if (!_hcons_is_list(v) || (v->flags & LVAL_HCONS)) {
+        return v;
+    }
+    if (v->rc != 1 || (v->flags & (LVAL_VEC | LVAL_ARENA)) || v->base) {
+        return v;
+    }
+    int ok = 1;
+    for (int i = 0; i < v->count; ++i) {
+        v->cell[i] = hcons_intern(v->cell[i]);
+        ok = ok && _hcons_can_hold(v->cell[i]);
+    }
+    if (!ok) {
+        return v;
+    }
+
+    if (2 * (hcons.used + 1) > hcons.capacity) {
+        _hcons_grow();
+    }
+    uint32_t mask = hcons.capacity - 1;
+    uint32_t i = _hcons_hash(v) & mask;
+    lval** free_slot = NULL;
+    for (; hcons.slots[i]; i = (i + 1) & mask) {
+        lval* x = hcons.slots[i];
+        if (x == &_hcons_tombstone) {
+            if (!free_slot) {
+                free_slot = &hcons.slots[i];
+            }
+        } else if (_hcons_equals(x, v)) {
+            lval_del(v);
+            return lval_copy(x);
+        }
+    }
+    if (!free_slot) {
+        free_slot = &hcons.slots[i];
+        hcons.used++;
+    }
+    *free_slot = v;
+    hcons.count++;
+    v->flags |= LVAL_HCONS;
+    return v;
+}
+
+void hcons_forget(lval* v) {
+    uint32_t mask = hcons.capacity - 1;
+    uint32_t i = _hcons_hash(v) & mask;
+    while (hcons.slots[i] != v) {
+        i = (i + 1) & mask;
+    }
+    hcons.slots[i] = &_hcons_tombstone;
+    hcons.count--;
+    v->flags &= ~LVAL_HCONS;
+}
+
+void hcons_tear_down(void) {
+    free(hcons.slots);
+    memset(&hcons, 0, sizeof(hcons));
+}
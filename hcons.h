@@ -0,0 +1,21 @@
+#ifndef HCONS_H
+#define HCONS_H
+
+#include "lval.h"
+
+/* Hash-consing of code lists. hcons_intern returns the unique list
+ * structurally equal to v, so identical subtrees read from source or
+ * captured by lambdas share storage. Interned lists are marked with
+ * LVAL_HCONS and compared by pointer when their parents are hashed.
+ *
+ * The table holds no references: a list leaves it when it is freed,
+ * or when lval_unshare hands its only reference out for modification.
+ * Only lists of numbers, strings, symbols and interned lists qualify,
+ * and nothing allocated in the lval arena; anything else is returned as
+ * is. */
+
+lval* hcons_intern(lval* v);
+void hcons_forget(lval* v);
+void hcons_tear_down(void);
+
+#endif
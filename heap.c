@@ -0,0 +1,193 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+
+#define HEAP_NCLASSES (HEAP_MAX_SMALL / HEAP_GRAIN)
+
+typedef struct heap_slot {
+    struct heap_slot* next;
+} heap_slot;
+
+typedef struct heap_slab {
+    struct heap_slab* next;
+} heap_slab;
+
+static struct {
+    heap_slot* free[HEAP_NCLASSES];
+    char* bump[HEAP_NCLASSES];
+    char* end[HEAP_NCLASSES];
+    heap_slab* slabs;
+} heap;
+
+typedef struct heap_chunk {
+    struct heap_chunk* next;
+} heap_chunk;
+
+static struct {
+    heap_chunk* chunks;
+    heap_chunk* current;
+    char* bump;
+    char* end;
+} arena;
+
+heap_stats_t heap_stats;
+
+static char* heap_kind_names[HEAP_NKINDS] = { "lval", "lenv", "array", "vec" };
+
+static int _heap_class(size_t size) {
+    return (size + HEAP_GRAIN - 1) / HEAP_GRAIN - 1;
+}
+
+static void* _heap_refill(int c) {
+    size_t size = (c + 1) * HEAP_GRAIN;
+    if (!heap.bump[c] || heap.bump[c] + size > heap.end[c]) {
+        heap_slab* slab = malloc(sizeof(heap_slab) + HEAP_SLAB_SIZE);
+        slab->next = heap.slabs;
+        heap.slabs = slab;
+        heap_stats.slabs++;
+        heap.bump[c] = (char*)(slab + 1);
+        heap.end[c] = heap.bump[c] + HEAP_SLAB_SIZE;
+    }
+    void* ret = heap.bump[c];
+    heap.bump[c] += size;
+    return ret;
+}
+
+void* heap_alloc(int kind, size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    heap_counter* counter = &heap_stats.kinds[kind];
+    counter->allocs++;
+    if (++counter->live > counter->peak) {
+        counter->peak = counter->live;
+    }
+
+    if (size > HEAP_MAX_SMALL) {
+        heap_stats.large_bytes += size;
+        return malloc(size);
+    }
+    int c = _heap_class(size);
+    heap_slot* slot = heap.free[c];
+    if (slot) {
+        heap.free[c] = slot->next;
+        return slot;
+    }
+    return _heap_refill(c);
+}
+
+void* heap_calloc(int kind, size_t size) {
+    void* ret = heap_alloc(kind, size);
+    memset(ret, 0, size);
+    return ret;
+}
+
+void* heap_realloc(int kind, void* p, size_t old_size, size_t new_size) {
+    if (!p) {
+        return heap_alloc(kind, new_size);
+    }
+    if (new_size == 0) {
+        heap_free(kind, p, old_size);
+        return NULL;
+    }
+    if (old_size <= HEAP_MAX_SMALL && new_size <= HEAP_MAX_SMALL &&
+        _heap_class(old_size) == _heap_class(new_size)) {
+        return p;
+    }
+    if (old_size > HEAP_MAX_SMALL && new_size > HEAP_MAX_SMALL) {
+        heap_stats.large_bytes += new_size - old_size;
+        return realloc(p, new_size);
+    }
+    void* ret = heap_alloc(kind, new_size);
+    memcpy(ret, p, old_size < new_size ? old_size : new_size);
+    heap_free(kind, p, old_size);
+    return ret;
+}
+
+void heap_free(int kind, void* p, size_t size) {
+    if (!p) {
+        return;
+    }
+    assert( heap_stats.kinds[kind].live > 0 );
+    heap_stats.kinds[kind].live--;
+
+    if (size > HEAP_MAX_SMALL) {
+        heap_stats.large_bytes -= size;
+        free(p);
+        return;
+    }
+    int c = _heap_class(size);
+    heap_slot* slot = p;
+    slot->next = heap.free[c];
+    heap.free[c] = slot;
+}
+
+void* heap_arena_alloc(size_t size) {
+    size = (size + HEAP_GRAIN - 1) / HEAP_GRAIN * HEAP_GRAIN;
+    assert( size <= HEAP_ARENA_CHUNK );
+    if (heap_stats.arena_bytes + size > HEAP_ARENA_MAX) {
+        return NULL;
+    }
+    if (!arena.bump || arena.bump + size > arena.end) {
+        heap_chunk* next = arena.current ? arena.current->next : arena.chunks;
+        if (!next) {
+            next = malloc(sizeof(heap_chunk) + HEAP_ARENA_CHUNK);
+            next->next = NULL;
+            if (arena.current) {
+                arena.current->next = next;
+            } else {
+                arena.chunks = next;
+            }
+        }
+        arena.current = next;
+        arena.bump = (char*)(next + 1);
+        arena.end = arena.bump + HEAP_ARENA_CHUNK;
+    }
+    void* ret = arena.bump;
+    arena.bump += size;
+    heap_stats.arena_allocs++;
+    heap_stats.arena_bytes += size;
+    if (heap_stats.arena_bytes > heap_stats.arena_peak) {
+        heap_stats.arena_peak = heap_stats.arena_bytes;
+    }
+    return ret;
+}
+
+void heap_arena_release(void) {
+    arena.current = NULL;
+    arena.bump = arena.end = NULL;
+    heap_stats.arena_bytes = 0;
+    heap_stats.arena_releases++;
+}
+
+void heap_print_stats(FILE* out) {
+    fprintf(out, "%-6s %10s %10s %10s\n", "kind", "allocs", "live", "peak");
+    for (int i = 0; i < HEAP_NKINDS; ++i) {
+        heap_counter* c = &heap_stats.kinds[i];
+        fprintf(out, "%-6s %10li %10li %10li\n",
+                heap_kind_names[i], c->allocs, c->live, c->peak);
+    }
+    fprintf(out, "slabs: %li (%li KiB), large blocks: %li bytes\n",
+            heap_stats.slabs, heap_stats.slabs * HEAP_SLAB_SIZE / 1024,
+            heap_stats.large_bytes);
+    fprintf(out, "arena: %li allocs, peak %li KiB, %li releases\n",
+            heap_stats.arena_allocs, heap_stats.arena_peak / 1024,
+            heap_stats.arena_releases);
+}
+
+void heap_tear_down(void) {
+    while (heap.slabs) {
+        heap_slab* next = heap.slabs->next;
+        free(heap.slabs);
+        heap.slabs = next;
+    }
+    memset(&heap, 0, sizeof(heap));
+    while (arena.chunks) {
+        heap_chunk* next = arena.chunks->next;
+        free(arena.chunks);
+        arena.chunks = next;
+    }
+    memset(&arena, 0, sizeof(arena));
+}
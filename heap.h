@@ -0,0 +1,62 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Size-class slab allocator for the interpreter's small objects.
+ *
+ * Requests up to HEAP_MAX_SMALL bytes are rounded up to a multiple of
+ * HEAP_GRAIN and served from per-class free lists, refilled by carving
+ * HEAP_SLAB_SIZE slabs. Larger requests go to malloc. Callers pass the
+ * size back on free, so blocks carry no header. Slabs are only returned
+ * to the system by heap_tear_down. */
+
+#define HEAP_GRAIN 8
+#define HEAP_MAX_SMALL 256
+#define HEAP_SLAB_SIZE (16 * 1024)
+
+/* A bump-allocated region for short-lived objects. Blocks from
+ * heap_arena_alloc are never freed individually; heap_arena_release
+ * reclaims all of them at once. Allocation fails, returning NULL, once
+ * HEAP_ARENA_MAX bytes are in use. Chunks are kept for reuse until
+ * heap_tear_down. */
+#define HEAP_ARENA_CHUNK (64 * 1024)
+#define HEAP_ARENA_MAX (4 * 1024 * 1024)
+
+enum { HEAP_LVAL,
+       HEAP_LENV,
+       HEAP_ARRAY,
+       HEAP_VEC,
+       HEAP_NKINDS };
+
+typedef struct {
+    long allocs;
+    long live;
+    long peak;
+} heap_counter;
+
+typedef struct {
+    heap_counter kinds[HEAP_NKINDS];
+    long slabs;
+    long large_bytes;
+    long arena_allocs;
+    long arena_bytes;
+    long arena_peak;
+    long arena_releases;
+} heap_stats_t;
+
+extern heap_stats_t heap_stats;
+
+void* heap_alloc(int kind, size_t size);
+void* heap_calloc(int kind, size_t size);
+void* heap_realloc(int kind, void* p, size_t old_size, size_t new_size);
+void heap_free(int kind, void* p, size_t size);
+
+void* heap_arena_alloc(size_t size);
+void heap_arena_release(void);
+
+void heap_print_stats(FILE* out);
+void heap_tear_down(void);
+
+#endif
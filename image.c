@@ -0,0 +1,1239 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "eval.h"
+#include "hcons.h"
+#include "image.h"
+#include "symtab.h"
+
+#define IMAGE_MAGIC "LISPYIMG"
+#define IMAGE_VERSION 1
+
+/* An image is the magic and version, a sequence of records ended by
+ * IMAGE_END, then the global bindings. Each record defines the next
+ * value, numbered from 0, and refers to earlier values by number, so
+ * children always come before their parents. Integers are stored in
+ * host byte order and strings as a length followed by the bytes and a
+ * terminating NUL. */
+enum { IMAGE_END,
+       IMAGE_FIXNUM,
+       IMAGE_BIG,
+       IMAGE_FLT,
+       IMAGE_STR,
+       IMAGE_SYM,
+       IMAGE_ERR,
+       IMAGE_QEXPR,
+       IMAGE_SEXPR,
+       IMAGE_BUILTIN,
+       IMAGE_LAMBDA };
+
+/* Or'ed into the tag of a list that was interned by hcons. */
+#define IMAGE_HCONS 0x80
+
+/* Values of a writer's table before and while a value is written. */
+#define IMAGE_NEW -2
+#define IMAGE_BUSY -1
+
+/* Maps addresses to what a writer made of them. */
+typedef struct {
+    int count;
+    int capacity;
+    void** keys;
+    int64_t* vals;
+} image_table;
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} image_buf;
+
+typedef struct {
+    image_buf out;
+    int n;
+    /* Number of every boxed value written so far. */
+    image_table seen;
+    lenv* builtins;
+} image_writer;
+
+static lval* _image_error(char* what, char* path) {
+    char msg[512];
+    snprintf(msg, sizeof(msg), "image: %s \"%s\"", what, path);
+    return lval_err_str(lval_str(msg));
+}
+
+static void _image_buf_put(image_buf* b, void* p, size_t n) {
+    if (b->len + n > b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 4096;
+        while (b->cap < b->len + n) {
+            b->cap *= 2;
+        }
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void _image_put(image_writer* w, void* p, size_t n) {
+    _image_buf_put(&w->out, p, n);
+}
+
+static void _image_put_u8(image_writer* w, unsigned char x) {
+    _image_put(w, &x, sizeof(x));
+}
+
+static void _image_put_i32(image_writer* w, int32_t x) {
+    _image_put(w, &x, sizeof(x));
+}
+
+static void _image_put_str(image_writer* w, char* s, int len) {
+    _image_put_i32(w, len);
+    _image_put(w, s, len);
+    _image_put_u8(w, '\0');
+}
+
+static uint32_t _image_hash(void* p) {
+    return (uint32_t)(((uintptr_t)p >> 3) * 2654435761u);
+}
+
+static void _image_grow(image_table* t) {
+    int capacity = t->capacity ? 2 * t->capacity : 256;
+    void** keys = calloc(capacity, sizeof(void*));
+    int64_t* vals = malloc(sizeof(int64_t) * capacity);
+    for (int i = 0; i < t->capacity; ++i) {
+        if (t->keys[i]) {
+            uint32_t j = _image_hash(t->keys[i]) & (capacity - 1);
+            while (keys[j]) {
+                j = (j + 1) & (capacity - 1);
+            }
+            keys[j] = t->keys[i];
+            vals[j] = t->vals[i];
+        }
+    }
+    free(t->keys);
+    free(t->vals);
+    t->keys = keys;
+    t->vals = vals;
+    t->capacity = capacity;
+}
+
+/* Returns the entry for p, which is IMAGE_NEW if it was just added. */
+static int64_t* _image_slot(image_table* t, void* p) {
+    if (2 * (t->count + 1) > t->capacity) {
+        _image_grow(t);
+    }
+    uint32_t mask = t->capacity - 1;
+    uint32_t i = _image_hash(p) & mask;
+    for (; t->keys[i]; i = (i + 1) & mask) {
+        if (t->keys[i] == p) {
+            return &t->vals[i];
+        }
+    }
+    t->keys[i] = p;
+    t->vals[i] = IMAGE_NEW;
+    t->count++;
+    return &t->vals[i];
+}
+
+static void _image_table_free(image_table* t) {
+    free(t->keys);
+    free(t->vals);
+}
+
+static char* _image_builtin_name(lenv* builtins, lbuiltin builtin) {
+    for (int i = 0; i < builtins->count; ++i) {
+        if (builtins->vals[i]->builtin == builtin) {
+            return builtins->syms[i];
+        }
+    }
+    return NULL;
+}
+
+static int _image_write(image_writer* w, lval* v);
+
+/* Writes the values in vals and stores their numbers in nums. */
+static int _image_write_all(image_writer* w, lval** vals, int* nums, int n) {
+    for (int i = 0; i < n; ++i) {
+        nums[i] = _image_write(w, vals[i]);
+        if (nums[i] < 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int _image_write_record(image_writer* w, lval* v) {
+    switch (v->type) {
+    case LVAL_ERR:
+        {
+            char msg[512];
+            lval_err_message(v, msg, sizeof(msg));
+            _image_put_u8(w, IMAGE_ERR);
+            _image_put_str(w, msg, strlen(msg));
+            break;
+        }
+    case LVAL_FLT:
+        _image_put_u8(w, IMAGE_FLT);
+        _image_put(w, &v->flt, sizeof(v->flt));
+        break;
+    case LVAL_FUN:
+        if (lval_is_builtin(v)) {
+            char* name = _image_builtin_name(w->builtins, v->builtin);
+            if (!name) {
+                return -1;
+            }
+            _image_put_u8(w, IMAGE_BUILTIN);
+            _image_put_str(w, name, strlen(name));
+        } else {
+            int formals = _image_write(w, v->formals);
+            int body = _image_write(w, v->body);
+            lenv* e = v->env;
+            int* nums = malloc(sizeof(int) * (e->count + 1));
+            if (formals < 0 || body < 0 ||
+                !_image_write_all(w, e->vals, nums, e->count)) {
+                free(nums);
+                return -1;
+            }
+            _image_put_u8(w, IMAGE_LAMBDA);
+            _image_put_i32(w, formals);
+            _image_put_i32(w, body);
+            _image_put_i32(w, e->count);
+            for (int i = 0; i < e->count; ++i) {
+                _image_put_str(w, e->syms[i], strlen(e->syms[i]));
+                _image_put_i32(w, nums[i]);
+            }
+            free(nums);
+        }
+        break;
+    case LVAL_NUM:
+        _image_put_u8(w, IMAGE_BIG);
+        _image_put_u8(w, v->big.neg);
+        _image_put_i32(w, v->big.len);
+        _image_put(w, v->big.digits, sizeof(uint32_t) * v->big.len);
+        break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+        {
+            int* nums = malloc(sizeof(int) * (v->count + 1));
+            for (int i = 0; i < v->count; ++i) {
+                nums[i] = _image_write(w, lval_item(v, i));
+                if (nums[i] < 0) {
+                    free(nums);
+                    return -1;
+                }
+            }
+            int tag = v->type == LVAL_QEXPR ? IMAGE_QEXPR : IMAGE_SEXPR;
+            if (v->flags & LVAL_HCONS) {
+                tag |= IMAGE_HCONS;
+            }
+            _image_put_u8(w, tag);
+            _image_put_i32(w, v->count);
+            for (int i = 0; i < v->count; ++i) {
+                _image_put_i32(w, nums[i]);
+            }
+            free(nums);
+            break;
+        }
+    case LVAL_STR:
+        _image_put_u8(w, IMAGE_STR);
+        _image_put_str(w, v->str, v->len);
+        break;
+    case LVAL_SYM:
+        _image_put_u8(w, IMAGE_SYM);
+        _image_put_str(w, v->sym, strlen(v->sym));
+        break;
+    default:
+        assert( 0 );
+    }
+    return w->n++;
+}
+
+/* Returns the number of v's record, writing it first if needed, or -1
+ * if v cannot be saved. */
+static int _image_write(image_writer* w, lval* v) {
+    if (lval_is_fixnum(v)) {
+        int64_t x = lval_num_value(v);
+        _image_put_u8(w, IMAGE_FIXNUM);
+        _image_put(w, &x, sizeof(x));
+        return w->n++;
+    }
+    int64_t* slot = _image_slot(&w->seen, v);
+    if (*slot != IMAGE_NEW) {
+        return *slot;
+    }
+    *slot = IMAGE_BUSY;
+    int num = _image_write_record(w, v);
+    *_image_slot(&w->seen, v) = num;
+    return num;
+}
+
+lval* image_save(lenv* e, char* path) {
+    image_writer w = { 0 };
+    w.builtins = lenv_new();
+    lenv_add_builtins(w.builtins);
+
+    _image_put(&w, IMAGE_MAGIC, strlen(IMAGE_MAGIC));
+    _image_put_i32(&w, IMAGE_VERSION);
+    int* nums = malloc(sizeof(int) * (e->count + 1));
+    int ok = _image_write_all(&w, e->vals, nums, e->count);
+    _image_put_u8(&w, IMAGE_END);
+    _image_put_i32(&w, e->count);
+    for (int i = 0; ok && i < e->count; ++i) {
+        _image_put_str(&w, e->syms[i], strlen(e->syms[i]));
+        _image_put_i32(&w, nums[i]);
+    }
+    free(nums);
+    _image_table_free(&w.seen);
+    lenv_del(w.builtins);
+
+    lval* ret;
+    FILE* f;
+    if (!ok) {
+        ret = _image_error("cannot save a cyclic value to", path);
+    } else if (!(f = fopen(path, "wb"))) {
+        ret = _image_error("cannot open", path);
+    } else {
+        size_t n = fwrite(w.out.data, 1, w.out.len, f);
+        if (fclose(f) != 0 || n != w.out.len) {
+            ret = _image_error("cannot write", path);
+        } else {
+            ret = lval_sexpr();
+        }
+    }
+    free(w.out.data);
+    return ret;
+}
+
+typedef struct {
+    char* p;
+    char* end;
+    int ok;
+    int n;
+    int cap;
+    lval** vals;
+    lenv* builtins;
+} image_reader;
+
+static void _image_get(image_reader* r, void* out, size_t n) {
+    if (!r->ok || (size_t)(r->end - r->p) < n) {
+        r->ok = 0;
+        memset(out, 0, n);
+        return;
+    }
+    memcpy(out, r->p, n);
+    r->p += n;
+}
+
+static int _image_get_u8(image_reader* r) {
+    unsigned char x;
+    _image_get(r, &x, sizeof(x));
+    return x;
+}
+
+static int32_t _image_get_i32(image_reader* r) {
+    int32_t x;
+    _image_get(r, &x, sizeof(x));
+    return x;
+}
+
+/* A count of items of the given size, which must all fit in what is
+ * left of the image. */
+static int _image_get_count(image_reader* r, size_t size) {
+    int32_t n = _image_get_i32(r);
+    if (n < 0 || (size_t)(r->end - r->p) / size < (size_t)n) {
+        r->ok = 0;
+        return 0;
+    }
+    return n;
+}
+
+/* Returns a pointer into the image, or "" if it is malformed. */
+static char* _image_get_str(image_reader* r) {
+    int len = _image_get_count(r, 1);
+    if (!r->ok || r->end - r->p < len + 1 || r->p[len] != '\0') {
+        r->ok = 0;
+        return "";
+    }
+    char* ret = r->p;
+    r->p += len + 1;
+    return ret;
+}
+
+/* Returns an earlier value, without taking a reference, or NULL. */
+static lval* _image_get_ref(image_reader* r) {
+    int32_t i = _image_get_i32(r);
+    if (!r->ok || i < 0 || i >= r->n) {
+        r->ok = 0;
+        return NULL;
+    }
+    return r->vals[i];
+}
+
+static void _image_bind(lenv* e, char* sym, lval* v) {
+    lval* k = lval_sym(sym);
+    lenv_put(e, k, v);
+    lval_del(k);
+}
+
+static lval* _image_read_list(image_reader* r, int tag) {
+    int n = _image_get_count(r, sizeof(int32_t));
+    lval* ret = (tag & ~IMAGE_HCONS) == IMAGE_QEXPR ? lval_qexpr() : lval_sexpr();
+    lval_reserve(ret, n);
+    for (int i = 0; i < n; ++i) {
+        lval* x = _image_get_ref(r);
+        if (!x) {
+            break;
+        }
+        lval_add(ret, lval_copy(x));
+    }
+    return tag & IMAGE_HCONS ? hcons_intern(ret) : ret;
+}
+
+static int _image_is_formals(lval* v) {
+    if (lval_type(v) != LVAL_QEXPR) {
+        return 0;
+    }
+    for (int i = 0; i < v->count; ++i) {
+        if (lval_type(lval_item(v, i)) != LVAL_SYM) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static lval* _image_read_lambda(image_reader* r) {
+    lval* formals = _image_get_ref(r);
+    lval* body = _image_get_ref(r);
+    if (!formals || !body || !_image_is_formals(formals) ||
+        lval_type(body) != LVAL_QEXPR) {
+        r->ok = 0;
+        return NULL;
+    }
+    lval* ret = lval_lambda(lval_copy(formals), lval_copy(body));
+    int n = _image_get_count(r, sizeof(int32_t));
+    for (int i = 0; i < n && r->ok; ++i) {
+        char* sym = _image_get_str(r);
+        lval* x = _image_get_ref(r);
+        if (x) {
+            _image_bind(ret->env, sym, x);
+        }
+    }
+    return ret;
+}
+
+/* Returns the value of the next record, or NULL if it is malformed. */
+static lval* _image_read_record(image_reader* r, int tag) {
+    switch (tag & ~IMAGE_HCONS) {
+    case IMAGE_FIXNUM:
+        {
+            int64_t x;
+            _image_get(r, &x, sizeof(x));
+            return lval_num(x);
+        }
+    case IMAGE_BIG:
+        {
+            bignum big;
+            big.neg = _image_get_u8(r);
+            big.len = _image_get_count(r, sizeof(uint32_t));
+            if (!r->ok || big.len == 0 || big.neg > 1) {
+                r->ok = 0;
+                return NULL;
+            }
+            big.digits = malloc(sizeof(uint32_t) * big.len);
+            _image_get(r, big.digits, sizeof(uint32_t) * big.len);
+            if (big.digits[big.len - 1] == 0) {
+                big_free(&big);
+                r->ok = 0;
+                return NULL;
+            }
+            return lval_num_big(&big);
+        }
+    case IMAGE_FLT:
+        {
+            double x;
+            _image_get(r, &x, sizeof(x));
+            return lval_flt(x);
+        }
+    case IMAGE_STR:
+        return lval_str(_image_get_str(r));
+    case IMAGE_SYM:
+        return lval_sym(_image_get_str(r));
+    case IMAGE_ERR:
+        return lval_err_str(lval_str(_image_get_str(r)));
+    case IMAGE_QEXPR:
+    case IMAGE_SEXPR:
+        return _image_read_list(r, tag);
+    case IMAGE_BUILTIN:
+        {
+            lval* k = lval_sym(_image_get_str(r));
+            lval* ret = lenv_get(r->builtins, k);
+            lval_del(k);
+            if (lval_type(ret) != LVAL_FUN) {
+                lval_del(ret);
+                r->ok = 0;
+                return NULL;
+            }
+            return ret;
+        }
+    case IMAGE_LAMBDA:
+        return _image_read_lambda(r);
+    default:
+        r->ok = 0;
+        return NULL;
+    }
+}
+
+static char* _image_read_file(char* path, size_t* size) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    char* data = NULL;
+    long n;
+    if (fseek(f, 0, SEEK_END) == 0 && (n = ftell(f)) >= 0 &&
+        fseek(f, 0, SEEK_SET) == 0) {
+        data = malloc(n + 1);
+        if (fread(data, 1, n, f) != (size_t)n) {
+            free(data);
+            data = NULL;
+        }
+        *size = n;
+    }
+    fclose(f);
+    return data;
+}
+
+/* Mapped images hold the values themselves, laid out as read-only
+ * lvals for the address IMAGE_MAP_BASE, so that they can be mapped
+ * and used in place by any number of processes.
+ *
+ * The data starts IMAGE_MAP_ALIGN bytes into the file, in two
+ * sections. The loader writes the fixed section once, to fill in what
+ * differs between processes: interned symbol names and builtin
+ * pointers. It leaves the shared section alone unless the data cannot
+ * be mapped at its base address; then it adds the difference to every
+ * pointer word listed in the relocation table, which makes those pages
+ * private. The relocation, fixup and binding tables follow the data,
+ * and all of their offsets are relative to its start. */
+#define IMAGE_MAP_MAGIC "LISPYMAP"
+#define IMAGE_MAP_BASE ((uintptr_t)0x3e0000000000)
+#define IMAGE_MAP_ALIGN 65536
+/* Mapped values are never freed; their reference count is only read,
+ * and must never look unshared. */
+#define IMAGE_MAP_RC (1 << 30)
+
+enum { IMAGE_FIXED, IMAGE_SHARED };
+enum { IMAGE_FIX_SYM, IMAGE_FIX_BUILTIN };
+
+typedef struct {
+    char magic[8];
+    uint64_t version;
+    uint64_t base;
+    uint64_t fixed;
+    uint64_t size;
+    uint64_t n_relocs;
+    uint64_t n_fixups;
+    uint64_t n_bindings;
+} image_map_header;
+
+/* Stores the interned name at `at` for IMAGE_FIX_SYM, or points the
+ * builtin lval at `at` to the builtin of that name. */
+typedef struct {
+    uint64_t kind;
+    uint64_t at;
+    uint64_t name;
+} image_fixup;
+
+/* val is a fixnum, which has its low bit set, or the offset of an lval. */
+typedef struct {
+    uint64_t name;
+    uint64_t val;
+} image_binding;
+
+/* While writing, a place in the data is a "ref": its offset in its
+ * section times two, plus the section. */
+typedef struct {
+    image_buf sec[2];
+    /* Pairs of refs: a pointer word and what it points to. */
+    image_buf relocs;
+    /* image_fixup and image_binding with refs for offsets, and for
+     * bindings a flag telling fixnums apart. */
+    image_buf fixups;
+    image_buf bindings;
+    image_table seen;
+    image_table syms;
+    image_table names;
+    lenv* builtins;
+} image_map_writer;
+
+static struct image_mapping {
+    void* data;
+    size_t size;
+    struct image_mapping* next;
+}* image_mappings;
+
+static int64_t _image_map_alloc(image_map_writer* w, int sec, size_t size) {
+    image_buf* b = &w->sec[sec];
+    size = (size + 7) & ~(size_t)7;
+    int64_t ref = (int64_t)b->len * 2 + sec;
+    char zeros[64] = { 0 };
+    for (; size > sizeof(zeros); size -= sizeof(zeros)) {
+        _image_buf_put(b, zeros, sizeof(zeros));
+    }
+    _image_buf_put(b, zeros, size);
+    return ref;
+}
+
+static void* _image_map_ptr(image_map_writer* w, int64_t ref) {
+    return w->sec[ref & 1].data + (ref >> 1);
+}
+
+static int64_t _image_map_at(int64_t ref, size_t bytes) {
+    return ref + 2 * (int64_t)bytes;
+}
+
+static void _image_map_reloc(image_map_writer* w, int64_t at, int64_t to) {
+    int64_t pair[2] = { at, to };
+    _image_buf_put(&w->relocs, pair, sizeof(pair));
+}
+
+static int64_t _image_map_name(image_map_writer* w, char* name) {
+    int64_t* slot = _image_slot(&w->names, name);
+    if (*slot == IMAGE_NEW) {
+        int len = strlen(name);
+        int64_t ref = _image_map_alloc(w, IMAGE_SHARED, len + 1);
+        memcpy(_image_map_ptr(w, ref), name, len);
+        *_image_slot(&w->names, name) = ref;
+        return ref;
+    }
+    return *slot;
+}
+
+static void _image_map_fixup(image_map_writer* w, int kind, int64_t at,
+                             char* name) {
+    int64_t fixup[3] = { kind, at, _image_map_name(w, name) };
+    _image_buf_put(&w->fixups, fixup, sizeof(fixup));
+}
+
+static int64_t _image_map_lval(image_map_writer* w, lval* v);
+
+/* Stores v in the word at `at`. */
+static int _image_map_value(image_map_writer* w, int64_t at, lval* v) {
+    if (lval_is_fixnum(v)) {
+        memcpy(_image_map_ptr(w, at), &v, sizeof(v));
+        return 1;
+    }
+    int64_t ref = _image_map_lval(w, v);
+    if (ref < 0) {
+        return 0;
+    }
+    _image_map_reloc(w, at, ref);
+    return 1;
+}
+
+static int64_t _image_map_env(image_map_writer* w, lenv* e) {
+    int64_t ref = _image_map_alloc(w, IMAGE_SHARED, sizeof(lenv));
+    lenv x = { 0 };
+    x.count = e->count;
+    memcpy(_image_map_ptr(w, ref), &x, sizeof(x));
+    if (e->count == 0) {
+        return ref;
+    }
+    int64_t syms = _image_map_alloc(w, IMAGE_FIXED, sizeof(char*) * e->count);
+    int64_t vals = _image_map_alloc(w, IMAGE_SHARED, sizeof(lval*) * e->count);
+    _image_map_reloc(w, _image_map_at(ref, offsetof(lenv, syms)), syms);
+    _image_map_reloc(w, _image_map_at(ref, offsetof(lenv, vals)), vals);
+    for (int i = 0; i < e->count; ++i) {
+        _image_map_fixup(w, IMAGE_FIX_SYM,
+                         _image_map_at(syms, sizeof(char*) * i), e->syms[i]);
+        if (!_image_map_value(w, _image_map_at(vals, sizeof(lval*) * i),
+                              e->vals[i])) {
+            return -1;
+        }
+    }
+    return ref;
+}
+
+/* Returns the ref of v's copy, laying it out first if needed, or -1 if
+ * v cannot be mapped. Symbols without a slot hint are shared by name. */
+static int64_t _image_map_lval(image_map_writer* w, lval* v) {
+    int64_t* slot = v->type == LVAL_SYM && v->slot == 0 ?
+        _image_slot(&w->syms, v->sym) : _image_slot(&w->seen, v);
+    if (*slot != IMAGE_NEW) {
+        return *slot;
+    }
+    if (v->type == LVAL_ERR) {
+        return -1;
+    }
+    int fixed = v->type == LVAL_SYM ||
+        (v->type == LVAL_FUN && lval_is_builtin(v));
+    int64_t ref = _image_map_alloc(w, fixed ? IMAGE_FIXED : IMAGE_SHARED,
+                                   sizeof(lval));
+    *slot = ref;
+
+    lval x;
+    memset(&x, 0, sizeof(x));
+    x.type = v->type;
+    x.flags = LVAL_RDONLY;
+    x.rc = IMAGE_MAP_RC;
+    switch (v->type) {
+    case LVAL_FLT:
+        x.flt = v->flt;
+        break;
+    case LVAL_NUM:
+        x.big.neg = v->big.neg;
+        x.big.len = v->big.len;
+        break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+        x.count = x.cap = v->count;
+        break;
+    case LVAL_STR:
+        x.len = v->len;
+        break;
+    case LVAL_SYM:
+        x.slot = v->slot;
+        break;
+    }
+    memcpy(_image_map_ptr(w, ref), &x, sizeof(x));
+
+    int64_t to;
+    switch (v->type) {
+    case LVAL_FLT:
+        break;
+    case LVAL_FUN:
+        if (fixed) {
+            char* name = _image_builtin_name(w->builtins, v->builtin);
+            if (!name) {
+                return -1;
+            }
+            _image_map_fixup(w, IMAGE_FIX_BUILTIN, ref, name);
+            break;
+        }
+        if ((to = _image_map_env(w, v->env)) < 0 ||
+            !_image_map_value(w, _image_map_at(ref, offsetof(lval, formals)),
+                              v->formals) ||
+            !_image_map_value(w, _image_map_at(ref, offsetof(lval, body)),
+                              v->body)) {
+            return -1;
+        }
+        _image_map_reloc(w, _image_map_at(ref, offsetof(lval, env)), to);
+        break;
+    case LVAL_NUM:
+        to = _image_map_alloc(w, IMAGE_SHARED, sizeof(uint32_t) * v->big.len);
+        memcpy(_image_map_ptr(w, to), v->big.digits,
+               sizeof(uint32_t) * v->big.len);
+        _image_map_reloc(w, _image_map_at(ref, offsetof(lval, big.digits)), to);
+        break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+        to = _image_map_alloc(w, IMAGE_SHARED, sizeof(lval*) * v->count);
+        _image_map_reloc(w, _image_map_at(ref, offsetof(lval, cell)), to);
+        for (int i = 0; i < v->count; ++i) {
+            if (!_image_map_value(w, _image_map_at(to, sizeof(lval*) * i),
+                                  lval_item(v, i))) {
+                return -1;
+            }
+        }
+        break;
+    case LVAL_STR:
+        to = _image_map_alloc(w, IMAGE_SHARED, v->len + 1);
+        memcpy(_image_map_ptr(w, to), v->str, v->len);
+        _image_map_reloc(w, _image_map_at(ref, offsetof(lval, str)), to);
+        break;
+    case LVAL_SYM:
+        _image_map_fixup(w, IMAGE_FIX_SYM,
+                         _image_map_at(ref, offsetof(lval, sym)), v->sym);
+        break;
+    default:
+        assert( 0 );
+    }
+    return ref;
+}
+
+static int _image_map_write(image_map_writer* w, FILE* f) {
+    uint64_t fixed = (w->sec[IMAGE_FIXED].len + IMAGE_MAP_ALIGN - 1) /
+        IMAGE_MAP_ALIGN * IMAGE_MAP_ALIGN;
+    uint64_t start[2] = { 0, fixed };
+    #define OFFSET(ref) (start[(ref) & 1] + ((ref) >> 1))
+
+    int64_t* relocs = (int64_t*)w->relocs.data;
+    size_t n_relocs = w->relocs.len / sizeof(int64_t[2]);
+    for (size_t i = 0; i < n_relocs; ++i) {
+        uint64_t addr = IMAGE_MAP_BASE + OFFSET(relocs[2 * i + 1]);
+        memcpy(_image_map_ptr(w, relocs[2 * i]), &addr, sizeof(addr));
+        relocs[i] = OFFSET(relocs[2 * i]);
+    }
+    int64_t* fixups = (int64_t*)w->fixups.data;
+    size_t n_fixups = w->fixups.len / sizeof(int64_t[3]);
+    for (size_t i = 0; i < n_fixups; ++i) {
+        fixups[3 * i + 1] = OFFSET(fixups[3 * i + 1]);
+        fixups[3 * i + 2] = OFFSET(fixups[3 * i + 2]);
+    }
+    int64_t* bindings = (int64_t*)w->bindings.data;
+    size_t n_bindings = w->bindings.len / sizeof(int64_t[3]);
+    for (size_t i = 0; i < n_bindings; ++i) {
+        bindings[2 * i] = OFFSET(bindings[3 * i]);
+        bindings[2 * i + 1] = bindings[3 * i + 2] ?
+            bindings[3 * i + 1] : (int64_t)OFFSET(bindings[3 * i + 1]);
+    }
+    #undef OFFSET
+
+    image_map_header h = { IMAGE_MAP_MAGIC, IMAGE_VERSION, IMAGE_MAP_BASE,
+                           fixed, fixed + w->sec[IMAGE_SHARED].len,
+                           n_relocs, n_fixups, n_bindings };
+    return fwrite(&h, sizeof(h), 1, f) == 1 &&
+        fseek(f, IMAGE_MAP_ALIGN, SEEK_SET) == 0 &&
+        fwrite(w->sec[IMAGE_FIXED].data, 1, w->sec[IMAGE_FIXED].len, f) ==
+            w->sec[IMAGE_FIXED].len &&
+        fseek(f, IMAGE_MAP_ALIGN + fixed, SEEK_SET) == 0 &&
+        fwrite(w->sec[IMAGE_SHARED].data, 1, w->sec[IMAGE_SHARED].len, f) ==
+            w->sec[IMAGE_SHARED].len &&
+        fwrite(relocs, sizeof(uint64_t), n_relocs, f) == n_relocs &&
+        fwrite(fixups, sizeof(image_fixup), n_fixups, f) == n_fixups &&
+        fwrite(bindings, sizeof(image_binding), n_bindings, f) == n_bindings;
+}
+
+lval* image_save_mapped(lenv* e, char* path) {
+    image_map_writer w;
+    memset(&w, 0, sizeof(w));
+    w.builtins = lenv_new();
+    lenv_add_builtins(w.builtins);
+
+    int ok = 1;
+    for (int i = 0; ok && i < e->count; ++i) {
+        lval* v = e->vals[i];
+        int64_t binding[3] = { _image_map_name(&w, e->syms[i]),
+                               (intptr_t)v, lval_is_fixnum(v) };
+        if (!lval_is_fixnum(v)) {
+            binding[1] = _image_map_lval(&w, v);
+            ok = binding[1] >= 0;
+        }
+        _image_buf_put(&w.bindings, binding, sizeof(binding));
+    }
+
+    lval* ret;
+    FILE* f;
+    if (!ok) {
+        ret = _image_error("cannot map an error value to", path);
+    } else if (!(f = fopen(path, "wb"))) {
+        ret = _image_error("cannot open", path);
+    } else {
+        ok = _image_map_write(&w, f);
+        if (fclose(f) != 0 || !ok) {
+            ret = _image_error("cannot write", path);
+        } else {
+            ret = lval_sexpr();
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        free(w.sec[i].data);
+    }
+    free(w.relocs.data);
+    free(w.fixups.data);
+    free(w.bindings.data);
+    _image_table_free(&w.seen);
+    _image_table_free(&w.syms);
+    _image_table_free(&w.names);
+    lenv_del(w.builtins);
+    return ret;
+}
+
+/* Reads n items of the given size at offset `at` of f, or returns NULL. */
+static void* _image_map_table(FILE* f, uint64_t at, uint64_t n, size_t size,
+                              uint64_t file_size) {
+    if (at > file_size || n > (file_size - at) / size) {
+        return NULL;
+    }
+    void* ret = malloc(n * size + 1);
+    if (fseek(f, at, SEEK_SET) != 0 || fread(ret, size, n, f) != n) {
+        free(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+static int _image_map_word(image_map_header* h, uint64_t at, uint64_t end) {
+    return at % sizeof(uint64_t) == 0 && at < end &&
+        end - at >= sizeof(uint64_t) && end <= h->size;
+}
+
+static int _image_map_name_ok(char* data, image_map_header* h, uint64_t at) {
+    return at < h->size && memchr(data + at, '\0', h->size - at);
+}
+
+/* Checks the tables, and that relocated pointers stay inside the data.
+ * Records the kind of each fixup, plus one, in fixes, which has a byte
+ * per word of the fixed section. */
+static int _image_map_check(image_map_header* h, char* data,
+                            uint64_t* relocs, image_fixup* fixups,
+                            image_binding* bindings, unsigned char* fixes) {
+    for (uint64_t i = 0; i < h->n_relocs; ++i) {
+        uint64_t to;
+        if (!_image_map_word(h, relocs[i], h->size)) {
+            return 0;
+        }
+        memcpy(&to, data + relocs[i], sizeof(to));
+        if (to < h->base || to - h->base >= h->size) {
+            return 0;
+        }
+    }
+    for (uint64_t i = 0; i < h->n_fixups; ++i) {
+        image_fixup* x = &fixups[i];
+        uint64_t end = x->at + (x->kind == IMAGE_FIX_SYM ?
+                                sizeof(char*) : sizeof(lval));
+        if (x->kind > IMAGE_FIX_BUILTIN || end < x->at ||
+            !_image_map_word(h, x->at, end) || end > h->fixed ||
+            !_image_map_name_ok(data, h, x->name)) {
+            return 0;
+        }
+        fixes[x->at / sizeof(uint64_t)] = x->kind + 1;
+    }
+    for (uint64_t i = 0; i < h->n_bindings; ++i) {
+        image_binding* x = &bindings[i];
+        if (!_image_map_name_ok(data, h, x->name) ||
+            (!(x->val & 1) && !_image_map_word(h, x->val, h->size))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* The values reachable from the bindings, checked after the data has
+ * been patched: every pointer must land inside the data, and every
+ * lval must look exactly as the writer laid it out. */
+typedef struct {
+    image_map_header* h;
+    char* data;
+    unsigned char* fixes;
+    /* A byte per word of the data, set once an lval there is queued. */
+    unsigned char* seen;
+    lval** stack;
+    uint64_t n;
+    uint64_t cap;
+} image_map_walk;
+
+/* Stores the offset of p in the data, if n bytes there are inside it
+ * and p is word aligned. */
+static int _image_map_off(image_map_walk* w, void* p, uint64_t n,
+                          uint64_t* off) {
+    *off = (uintptr_t)p - (uintptr_t)w->data;
+    return (uintptr_t)p >= (uintptr_t)w->data && *off <= w->h->size &&
+        n <= w->h->size - *off && *off % sizeof(uint64_t) == 0;
+}
+
+static int _image_map_fixed(image_map_walk* w, uint64_t off, int kind) {
+    return off < w->h->fixed &&
+        w->fixes[off / sizeof(uint64_t)] == kind + 1;
+}
+
+static int _image_map_push(image_map_walk* w, lval* v) {
+    uint64_t off;
+    if (lval_is_fixnum(v)) {
+        return 1;
+    }
+    if (!_image_map_off(w, v, sizeof(lval), &off)) {
+        return 0;
+    }
+    if (w->seen[off / sizeof(uint64_t)]) {
+        return 1;
+    }
+    w->seen[off / sizeof(uint64_t)] = 1;
+    if (w->n == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 64;
+        w->stack = realloc(w->stack, sizeof(lval*) * w->cap);
+    }
+    w->stack[w->n++] = v;
+    return 1;
+}
+
+static int _image_map_walk_env(image_map_walk* w, lenv* e) {
+    uint64_t off;
+    if (!_image_map_off(w, e, sizeof(lenv), &off) || e->parent ||
+        e->index || e->index_cap || e->arena || e->global ||
+        e->count < 0 || (e->count == 0 && (e->syms || e->vals))) {
+        return 0;
+    }
+    if (e->count == 0) {
+        return 1;
+    }
+    uint64_t syms, vals;
+    if (!_image_map_off(w, e->syms, sizeof(char*) * e->count, &syms) ||
+        !_image_map_off(w, e->vals, sizeof(lval*) * e->count, &vals)) {
+        return 0;
+    }
+    for (int i = 0; i < e->count; ++i) {
+        if (!_image_map_fixed(w, syms + sizeof(char*) * i, IMAGE_FIX_SYM) ||
+            !_image_map_push(w, e->vals[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int _image_map_walk_lval(image_map_walk* w, lval* v) {
+    uint64_t off, to;
+    _image_map_off(w, v, sizeof(lval), &off);
+    if (v->flags != LVAL_RDONLY || v->rc != IMAGE_MAP_RC) {
+        return 0;
+    }
+    switch (v->type) {
+    case LVAL_FLT:
+        return 1;
+    case LVAL_FUN:
+        if (_image_map_fixed(w, off, IMAGE_FIX_BUILTIN)) {
+            return v->formals == NULL && v->body == NULL;
+        }
+        if (!_image_map_walk_env(w, v->env) ||
+            !_image_map_push(w, v->formals) || !_image_map_push(w, v->body) ||
+            lval_type(v->formals) != LVAL_QEXPR ||
+            lval_type(v->body) != LVAL_QEXPR) {
+            return 0;
+        }
+        /* _lval_call reads the formals' names before they are walked. */
+        if (v->formals->count > 0 &&
+            (v->formals->count != v->formals->cap ||
+             !_image_map_off(w, v->formals->cell,
+                             sizeof(lval*) * v->formals->count, &to))) {
+            return 0;
+        }
+        for (int i = 0; i < v->formals->count; ++i) {
+            lval* x = v->formals->cell[i];
+            if (!_image_map_push(w, x) || lval_type(x) != LVAL_SYM) {
+                return 0;
+            }
+        }
+        return 1;
+    case LVAL_NUM:
+        return v->big.len > 0 && (v->big.neg == 0 || v->big.neg == 1) &&
+            _image_map_off(w, v->big.digits,
+                           sizeof(uint32_t) * v->big.len, &to);
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+        if (v->count < 0 || v->cap != v->count || v->base ||
+            (v->count > 0 &&
+             !_image_map_off(w, v->cell, sizeof(lval*) * v->count, &to))) {
+            return 0;
+        }
+        for (int i = 0; i < v->count; ++i) {
+            if (!_image_map_push(w, v->cell[i])) {
+                return 0;
+            }
+        }
+        return 1;
+    case LVAL_STR:
+        return v->len >= 0 &&
+            _image_map_off(w, v->str, (uint64_t)v->len + 1, &to) &&
+            v->str[v->len] == '\0';
+    case LVAL_SYM:
+        return v->global == NULL &&
+            _image_map_fixed(w, off + offsetof(lval, sym), IMAGE_FIX_SYM);
+    default:
+        return 0;
+    }
+}
+
+static int _image_map_walk(image_map_header* h, char* data,
+                           image_binding* bindings, unsigned char* fixes) {
+    image_map_walk w = { h, data, fixes, NULL, NULL, 0, 0 };
+    w.seen = calloc(h->size / sizeof(uint64_t), 1);
+    int ok = 1;
+    for (uint64_t i = 0; ok && i < h->n_bindings; ++i) {
+        uint64_t val = bindings[i].val;
+        ok = val & 1 || _image_map_push(&w, (lval*)(data + val));
+    }
+    while (ok && w.n > 0) {
+        ok = _image_map_walk_lval(&w, w.stack[--w.n]);
+    }
+    free(w.seen);
+    free(w.stack);
+    return ok;
+}
+
+/* Patches the data mapped at `data` for this process. */
+static int _image_map_fix(image_map_header* h, char* data, uint64_t* relocs,
+                          image_fixup* fixups) {
+    uint64_t delta = (uintptr_t)data - h->base;
+    if (delta && h->n_relocs) {
+        if (mprotect(data, h->size, PROT_READ | PROT_WRITE) != 0) {
+            return 0;
+        }
+        for (uint64_t i = 0; i < h->n_relocs; ++i) {
+            uint64_t word;
+            memcpy(&word, data + relocs[i], sizeof(word));
+            word += delta;
+            memcpy(data + relocs[i], &word, sizeof(word));
+        }
+    }
+    if (h->fixed && mprotect(data, h->fixed, PROT_READ | PROT_WRITE) != 0) {
+        return 0;
+    }
+
+    lenv* builtins = lenv_new();
+    lenv_add_builtins(builtins);
+    int ok = 1;
+    for (uint64_t i = 0; ok && i < h->n_fixups; ++i) {
+        char* name = data + fixups[i].name;
+        if (fixups[i].kind == IMAGE_FIX_SYM) {
+            char* sym = symtab_intern(name);
+            memcpy(data + fixups[i].at, &sym, sizeof(sym));
+            continue;
+        }
+        lval* k = lval_sym(name);
+        lval* b = lenv_get(builtins, k);
+        lval* v = (lval*)(data + fixups[i].at);
+        ok = lval_type(b) == LVAL_FUN && v->type == LVAL_FUN;
+        if (ok) {
+            v->builtin = b->builtin;
+        }
+        lval_del(k);
+        lval_del(b);
+    }
+    lenv_del(builtins);
+    return mprotect(data, h->size, PROT_READ) == 0 && ok;
+}
+
+static lval* _image_map(lenv* e, char* path, FILE* f) {
+    image_map_header h;
+    struct stat st;
+    if (fseek(f, 0, SEEK_SET) != 0 || fread(&h, sizeof(h), 1, f) != 1 ||
+        fstat(fileno(f), &st) != 0) {
+        return _image_error("cannot read", path);
+    }
+    uint64_t file_size = st.st_size;
+    if (file_size < IMAGE_MAP_ALIGN || h.version != IMAGE_VERSION ||
+        h.fixed % IMAGE_MAP_ALIGN != 0 || h.fixed > h.size || h.size == 0 ||
+        h.size % sizeof(uint64_t) != 0 ||
+        h.size > file_size - IMAGE_MAP_ALIGN) {
+        return _image_error("corrupt image", path);
+    }
+    uint64_t at = IMAGE_MAP_ALIGN + h.size;
+    uint64_t* relocs = _image_map_table(f, at, h.n_relocs,
+                                        sizeof(uint64_t), file_size);
+    at += h.n_relocs * sizeof(uint64_t);
+    image_fixup* fixups = relocs ? _image_map_table(
+        f, at, h.n_fixups, sizeof(image_fixup), file_size) : NULL;
+    at += h.n_fixups * sizeof(image_fixup);
+    image_binding* bindings = fixups ? _image_map_table(
+        f, at, h.n_bindings, sizeof(image_binding), file_size) : NULL;
+
+    char* data = MAP_FAILED;
+    if (bindings) {
+        data = mmap((void*)h.base, h.size, PROT_READ, MAP_PRIVATE,
+                    fileno(f), IMAGE_MAP_ALIGN);
+    }
+    unsigned char* fixes = calloc(h.fixed / sizeof(uint64_t) + 1, 1);
+    int ok = data != MAP_FAILED &&
+        _image_map_check(&h, data, relocs, fixups, bindings, fixes) &&
+        _image_map_fix(&h, data, relocs, fixups) &&
+        _image_map_walk(&h, data, bindings, fixes);
+    free(fixes);
+
+    lval* ret;
+    if (ok) {
+        for (uint64_t i = 0; i < h.n_bindings; ++i) {
+            uint64_t val = bindings[i].val;
+            lval* v = val & 1 ? (lval*)(uintptr_t)val : (lval*)(data + val);
+            _image_bind(e, data + bindings[i].name, v);
+        }
+        struct image_mapping* m = malloc(sizeof(struct image_mapping));
+        m->data = data;
+        m->size = h.size;
+        m->next = image_mappings;
+        image_mappings = m;
+        ret = lval_sexpr();
+    } else {
+        if (data != MAP_FAILED) {
+            munmap(data, h.size);
+        }
+        ret = _image_error("corrupt image", path);
+    }
+    free(relocs);
+    free(fixups);
+    free(bindings);
+    return ret;
+}
+
+void image_tear_down(void) {
+    while (image_mappings) {
+        struct image_mapping* next = image_mappings->next;
+        munmap(image_mappings->data, image_mappings->size);
+        free(image_mappings);
+        image_mappings = next;
+    }
+}
+
+lval* image_load(lenv* e, char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return _image_error("cannot read", path);
+    }
+    char kind[sizeof(IMAGE_MAP_MAGIC) - 1];
+    if (fread(kind, sizeof(kind), 1, f) == 1 &&
+        memcmp(kind, IMAGE_MAP_MAGIC, sizeof(kind)) == 0) {
+        lval* ret = _image_map(e, path, f);
+        fclose(f);
+        return ret;
+    }
+    fclose(f);
+
+    size_t size;
+    char* data = _image_read_file(path, &size);
+    if (!data) {
+        return _image_error("cannot read", path);
+    }
+    image_reader r = { data, data + size, 1, 0, 0, NULL, NULL };
+    r.builtins = lenv_new();
+    lenv_add_builtins(r.builtins);
+
+    char magic[sizeof(IMAGE_MAGIC) - 1];
+    _image_get(&r, magic, sizeof(magic));
+    r.ok = r.ok && memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0 &&
+        _image_get_i32(&r) == IMAGE_VERSION;
+
+    for (int tag = _image_get_u8(&r); r.ok && tag != IMAGE_END;
+         tag = _image_get_u8(&r)) {
+        lval* v = _image_read_record(&r, tag);
+        if (!v) {
+            break;
+        }
+        if (r.n == r.cap) {
+            r.cap = r.cap ? 2 * r.cap : 256;
+            r.vals = realloc(r.vals, sizeof(lval*) * r.cap);
+        }
+        r.vals[r.n++] = v;
+    }
+
+    /* Check every binding before making any of them. */
+    int n = _image_get_count(&r, sizeof(int32_t) + 1);
+    char* bindings = r.p;
+    for (int i = 0; i < n && r.ok; ++i) {
+        _image_get_str(&r);
+        _image_get_ref(&r);
+    }
+    r.ok = r.ok && r.p == r.end;
+    if (r.ok) {
+        r.p = bindings;
+        for (int i = 0; i < n; ++i) {
+            char* sym = _image_get_str(&r);
+            _image_bind(e, sym, _image_get_ref(&r));
+        }
+    }
+
+    lval* ret = r.ok ? lval_sexpr() : _image_error("corrupt image", path);
+    for (int i = 0; i < r.n; ++i) {
+        lval_del(r.vals[i]);
+    }
+    free(r.vals);
+    lenv_del(r.builtins);
+    free(data);
+    return ret;
+}
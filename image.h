@@ -0,0 +1,26 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "lval.h"
+
+/* Heap images. image_save writes the bindings of a global environment,
+ * and every value reachable from them, to a file; image_load binds them
+ * in e again, so a process can start from an image instead of
+ * re-evaluating its preludes. Shared values stay shared, builtins are
+ * stored by name and relinked on load, and interned lists are interned
+ * again. Cyclic values cannot be saved.
+ *
+ * image_save_mapped writes a mapped image instead, which image_load
+ * maps read-only and uses in place: its values are marked LVAL_RDONLY
+ * and processes that map the same image share its pages. Errors cannot
+ * be mapped. Mapped images stay mapped until image_tear_down.
+ *
+ * Images are only meant to be read by the binary that wrote them. The
+ * functions return an error, or an empty S-expression on success. */
+
+lval* image_save(lenv* e, char* path);
+lval* image_save_mapped(lenv* e, char* path);
+lval* image_load(lenv* e, char* path);
+void image_tear_down(void);
+
+#endif
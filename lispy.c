@@ -1,42 +1,84 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <editline/readline.h>
 
+#include "hcons.h"
+#include "heap.h"
+#include "image.h"
 #include "lval.h"
 #include "eval.h"
 #include "parser.h"
+#include "symtab.h"
 
 int main(int argc, char** argv) {
     puts("Lispy version 0.0.0.4");
     puts("Press Ctrl-c to Exit\n");
 
-    init_parser();
+    int heap_stats_at_exit = 0;
+    char* image = NULL;
+    char* save_image = NULL;
+    char* save_mapped_image = NULL;
+    int n_files = 0;
+    char** files = malloc(sizeof(char*) * argc);
 
-    lenv* e = lenv_new();
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--heap-stats") == 0) {
+            heap_stats_at_exit = 1;
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (strcmp(argv[i], "--save-image") == 0 && i + 1 < argc) {
+            save_image = argv[++i];
+        } else if (strcmp(argv[i], "--save-mapped-image") == 0 &&
+                   i + 1 < argc) {
+            save_mapped_image = argv[++i];
+        } else if (strcmp(argv[i], "--arena") == 0) {
+            lval_arena = 1;
+        } else {
+            files[n_files++] = argv[i];
+        }
+    }
+
+    lenv* e = lenv_new_global();
     lenv_add_builtins(e);
 
-    if (argc > 1) {
-        for (int i = 1; i < argc; ++i) {
-            lval* args = lval_sexpr();
-            lval_add(args, lval_str(argv[i]));
-            lval* x = op_load(e, args);
-            if (x->type == LVAL_ERR) {
-                lval_println(x);
-            }
-            lval_del(x);
+    if (image) {
+        lval* x = image_load(e, image);
+        if (lval_type(x) == LVAL_ERR) {
+            lval_println(x);
+        }
+        lval_del(x);
+    }
+
+    for (int i = 0; i < n_files; ++i) {
+        lval* args = lval_sexpr();
+        lval_add(args, lval_str(files[i]));
+        lval* x = op_load(e, args);
+        if (lval_type(x) == LVAL_ERR) {
+            lval_println(x);
         }
+        lval_del(x);
     }
+    free(files);
+
     while (1) {
         char * input = readline("> ");
+        if (!input) {
+            break;
+        }
         add_history(input);
+        init_parser();
         mpc_result_t r;
         if(mpc_parse("<stdin>", input, Lispy, &r)) {
             lval* in = lval_read(r.output);
 
+            lval_arena_begin();
             lval* res  = lval_eval(e, in);
             lval_println(res);
+            lval_del(res);
+            lval_arena_end();
             mpc_ast_delete(r.output);
         } else {
             mpc_err_print(r.error);
@@ -44,7 +86,29 @@ int main(int argc, char** argv) {
         }
         free(input);
     }
+    if (save_image) {
+        lval* x = image_save(e, save_image);
+        if (lval_type(x) == LVAL_ERR) {
+            lval_println(x);
+        }
+        lval_del(x);
+    }
+    if (save_mapped_image) {
+        lval* x = image_save_mapped(e, save_mapped_image);
+        if (lval_type(x) == LVAL_ERR) {
+            lval_println(x);
+        }
+        lval_del(x);
+    }
     lenv_del(e);
     tear_down_parser();
+    if (heap_stats_at_exit) {
+        heap_print_stats(stderr);
+        lval_print_stats(stderr);
+    }
+    hcons_tear_down();
+    image_tear_down();
+    heap_tear_down();
+    symtab_tear_down();
     return 0;
 }
@@ -1,15 +1,20 @@
 #include <assert.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "hcons.h"
+#include "heap.h"
 #include "lval.h"
-#include "mpc.h"
+#include "symtab.h"
+#include "vec.h"
 
 char* lval_type_name(int type){
     switch (type) {
     case LVAL_ERR: return "Error";
+    case LVAL_FLT: return "Float";
     case LVAL_FUN: return "Function";
     case LVAL_NUM: return "Number";
     case LVAL_QEXPR: return "Q-Expression";
@@ -21,35 +26,246 @@ char* lval_type_name(int type){
     }
 }
 
-lval* _lval_new () {
-    return calloc(1, sizeof(lval));
+typedef union {
+    long num;
+    char* str;
+} lval_err_arg;
+
+static int _lval_is_list(int type) {
+    return type == LVAL_QEXPR || type == LVAL_SEXPR;
+}
+
+static size_t _lval_size(int type) {
+    if (_lval_is_list(type)) {
+        return sizeof(lval) + sizeof(lval*) * LVAL_INLINE_CELLS;
+    }
+    if (type == LVAL_STR) {
+        return sizeof(lval) + LVAL_INLINE_STR;
+    }
+    if (type == LVAL_ERR) {
+        return sizeof(lval) + sizeof(lval_err_arg) * LVAL_ERR_ARGS;
+    }
+    return sizeof(lval);
+}
+
+/* The inline storage that follows a list or a string. */
+static lval** _lval_inline_cells(lval* v) {
+    return (lval**)(v + 1);
+}
+
+static char* _lval_inline_str(lval* v) {
+    return (char*)(v + 1);
+}
+
+static lval_err_arg* _lval_err_args(lval* v) {
+    return (lval_err_arg*)(v + 1);
+}
+
+static void _lval_set_str(lval* v, char* str, int len) {
+    v->str = len < LVAL_INLINE_STR ? _lval_inline_str(v) : malloc(len + 1);
+    v->len = len;
+    memcpy(v->str, str, len);
+    v->str[len] = '\0';
+}
+
+lval_stats_t lval_stats;
+
+int lval_arena = 0;
+static int _lval_arena_depth = 0;
+static int _lval_in_arena = 0;
+
+void lval_arena_begin(void) {
+    if (lval_arena && _lval_arena_depth++ == 0) {
+        _lval_in_arena = 1;
+    }
+}
+
+void lval_arena_end(void) {
+    if (lval_arena && --_lval_arena_depth == 0) {
+        _lval_in_arena = 0;
+        heap_arena_release();
+    }
+}
+
+lval* _lval_new (int type) {
+    lval* ret;
+    size_t size = _lval_size(type);
+    if (_lval_in_arena && (ret = heap_arena_alloc(size))) {
+        memset(ret, 0, size);
+        ret->flags = LVAL_ARENA;
+    } else {
+        ret = heap_calloc(HEAP_LVAL, size);
+    }
+    ret->type = type;
+    ret->rc = 1;
+
+    lval_counter* c = &lval_stats.types[type];
+    c->allocs++;
+    if (++c->live > c->peak) {
+        c->peak = c->live;
+    }
+    return ret;
+}
+
+void _lval_free(lval* v) {
+    size_t size = _lval_size(v->type);
+    lval_stats.types[v->type].frees++;
+    lval_stats.types[v->type].live--;
+    if (v->flags & LVAL_ARENA) {
+        return;
+    }
+    heap_free(HEAP_LVAL, v, size);
 }
 
 lval* lval_err(char *fmt, ...) {
-    static const int buff_size = 512;
-    lval* ret = _lval_new();
-    ret->type = LVAL_ERR;
+    lval* ret = _lval_new(LVAL_ERR);
+    ret->fmt = fmt;
+    lval_err_arg* args = _lval_err_args(ret);
+    int n = 0;
 
     va_list va;
     va_start(va, fmt);
-    ret->err = malloc(buff_size);
-    vsnprintf(ret->err, buff_size - 1, fmt, va);
-    ret->err = realloc(ret->err, strlen(ret->err) + 1);
+    for (char* p = fmt; *p; ++p) {
+        if (*p != '%') {
+            continue;
+        }
+        int is_long = 0;
+        for (++p; *p == 'l'; ++p) {
+            is_long = 1;
+        }
+        if (*p == '%') {
+            continue;
+        }
+        assert( n < LVAL_ERR_ARGS );
+        if (*p == 's') {
+            args[n++].str = va_arg(va, char*);
+        } else {
+            assert( *p == 'i' || *p == 'd' );
+            args[n++].num = is_long ? va_arg(va, long) : va_arg(va, int);
+        }
+    }
     va_end(va);
 
     return ret;
 }
 
+lval* lval_err_str(lval* str) {
+    assert( str->type == LVAL_STR );
+    lval* ret = lval_err("%s", str->str);
+    ret->ref = str;
+    return ret;
+}
+
+/* Formats the message of error v into buf, truncating if needed. */
+void lval_err_message(lval* v, char* buf, int size) {
+    assert( v->type == LVAL_ERR && size > 0 );
+    lval_err_arg* args = _lval_err_args(v);
+    int n = 0;
+    int len = 0;
+    for (char* p = v->fmt; *p && len < size - 1; ++p) {
+        if (*p != '%') {
+            buf[len++] = *p;
+            continue;
+        }
+        for (++p; *p == 'l'; ++p) {
+        }
+        if (*p == 's') {
+            len += snprintf(buf + len, size - len, "%s", args[n++].str);
+        } else if (*p == 'i' || *p == 'd') {
+            len += snprintf(buf + len, size - len, "%ld", args[n++].num);
+        } else {
+            buf[len++] = *p;
+        }
+        if (len > size - 1) {
+            len = size - 1;
+        }
+    }
+    buf[len] = '\0';
+}
+
+lval* lval_flt(double flt) {
+    lval* ret = _lval_new(LVAL_FLT);
+    ret->flt = flt;
+    return ret;
+}
+
 lval* lval_builtin(lbuiltin builtin) {
-    lval* ret = _lval_new();
-    ret->type = LVAL_FUN;
+    lval* ret = _lval_new(LVAL_FUN);
     ret->builtin = builtin;
     return ret;
 }
 
+/* Returns the slot hint for sym among formals, or 0. Formals are
+ * bound in order, skipping the `&` marker. */
+static int _lval_formal_slot(lval* formals, char* sym) {
+    int slot = 0;
+    for (int i = 0; i < formals->count; ++i) {
+        char* f = lval_item(formals, i)->sym;
+        if (strcmp(f, "&") == 0) {
+            continue;
+        }
+        slot++;
+        if (f == sym) {
+            return slot;
+        }
+    }
+    return 0;
+}
+
+/* Returns v with the formals it mentions given their slot hints,
+ * consuming v. Lists are copied only along the paths that change. */
+static lval* _lval_resolve(lval* formals, lval* v) {
+    switch (lval_type(v)) {
+    case LVAL_SYM: {
+        int slot = _lval_formal_slot(formals, v->sym);
+        if (slot == 0 || slot == v->slot) {
+            return v;
+        }
+        lval* ret = _lval_new(LVAL_SYM);
+        ret->sym = v->sym;
+        ret->slot = slot;
+        ret->global = v->global;
+        lval_del(v);
+        return ret;
+    }
+    case LVAL_QEXPR:
+    case LVAL_SEXPR: {
+        lval* ret = NULL;
+        for (int i = 0; i < v->count; ++i) {
+            lval* x = lval_item(v, i);
+            lval* y = _lval_resolve(formals, lval_copy(x));
+            if (y != x && !ret) {
+                ret = v->type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+                lval_reserve(ret, v->count);
+                for (int j = 0; j < i; ++j) {
+                    lval_add(ret, lval_copy(lval_item(v, j)));
+                }
+            }
+            if (ret) {
+                lval_add(ret, y);
+            } else {
+                lval_del(y);
+            }
+        }
+        if (!ret) {
+            return v;
+        }
+        lval_del(v);
+        return ret;
+    }
+    default:
+        return v;
+    }
+}
+
+/* References to formals in body are resolved to frame slots here, so
+ * that looking them up is an index rather than a search. Scope is
+ * dynamic, so only the callee's own frame is known statically, and
+ * lenv_get checks each hint before trusting it. The resolved lists are
+ * interned again, so lambdas with the same body and formals share it. */
 lval* lval_lambda(lval* formals, lval* body) {
-    lval* ret = _lval_new();
-    ret->type = LVAL_FUN;
+    body = hcons_intern(_lval_resolve(formals, body));
+    lval* ret = _lval_new(LVAL_FUN);
     ret->formals = formals;
     ret->body = body;
     ret->env = lenv_new();
@@ -57,82 +273,342 @@ lval* lval_lambda(lval* formals, lval* body) {
 }
 
 lval* lval_num(long num) {
-    lval* ret = _lval_new();
-    ret->type = LVAL_NUM;
-    ret->num = num;
+    if (num >= LVAL_FIXNUM_MIN && num <= LVAL_FIXNUM_MAX) {
+        return (lval*)(((uintptr_t)num << 1) | 1);
+    }
+    lval* ret = _lval_new(LVAL_NUM);
+    big_from_long(&ret->big, num);
+    return ret;
+}
+
+/* Returns the number big, consuming it. */
+lval* lval_num_big(bignum* big) {
+    long num;
+    if (big_to_long(big, &num) &&
+        num >= LVAL_FIXNUM_MIN && num <= LVAL_FIXNUM_MAX) {
+        big_free(big);
+        return lval_num(num);
+    }
+    lval* ret = _lval_new(LVAL_NUM);
+    ret->big = *big;
     return ret;
 }
 
 lval* lval_qexpr(void) {
-    lval* ret = _lval_new();
-    ret->type = LVAL_QEXPR;
+    lval* ret = _lval_new(LVAL_QEXPR);
     ret->count = 0;
-    ret->cell = NULL;
+    ret->cap = LVAL_INLINE_CELLS;
+    ret->cell = _lval_inline_cells(ret);
     return ret;
 }
 
 lval* lval_sexpr(void) {
-    lval* ret = _lval_new();
-    ret->type = LVAL_SEXPR;
+    lval* ret = _lval_new(LVAL_SEXPR);
     ret->count = 0;
-    ret->cell = NULL;
+    ret->cap = LVAL_INLINE_CELLS;
+    ret->cell = _lval_inline_cells(ret);
     return ret;
 }
 
 lval* lval_str(char * str) {
-    lval*ret = _lval_new();
-    ret->type = LVAL_STR;
-    ret->str = malloc(strlen(str) + 1);
-    strcpy(ret->str, str);
+    lval*ret = _lval_new(LVAL_STR);
+    _lval_set_str(ret, str, strlen(str));
     return ret;
 }
 
+/* Cells are made on first use and freed by symtab_tear_down. */
+static lcell* _lval_cell(char* sym) {
+    void** data = symtab_data(sym);
+    if (!*data) {
+        *data = calloc(1, sizeof(lcell));
+    }
+    return *data;
+}
+
 lval* lval_sym(char* sym) {
-    lval* ret = _lval_new();
-    ret->type = LVAL_SYM;
-    ret->sym = malloc(strlen(sym) + 1);
-    strcpy(ret->sym, sym);
+    lval* ret = _lval_new(LVAL_SYM);
+    ret->sym = symtab_intern(sym);
+    ret->global = _lval_cell(ret->sym);
     return ret;
 }
 
+int lval_is_builtin(lval* v) {
+    assert( v->type == LVAL_FUN );
+    return v->formals == NULL;
+}
+
+int lval_is_view(lval* v) {
+    assert( v->type == LVAL_SEXPR || v->type == LVAL_QEXPR);
+    return !(v->flags & LVAL_VEC) && v->base;
+}
+
+/* Points v, which owns no cells, at storage for n of them. */
+static void _lval_alloc_cells(lval* v, int n) {
+    if (n <= LVAL_INLINE_CELLS) {
+        v->cell = _lval_inline_cells(v);
+        v->cap = LVAL_INLINE_CELLS;
+    } else {
+        v->cell = heap_alloc(HEAP_ARRAY, sizeof(lval*) * n);
+        v->cap = n;
+    }
+}
+
+static void _lval_free_cells(lval* v) {
+    if (v->cell != _lval_inline_cells(v)) {
+        heap_free(HEAP_ARRAY, v->cell, sizeof(lval*) * v->cap);
+    }
+}
+
+/* Moves the cells of an unshared Q-expression into a vector. */
+static void _lval_to_vec(lval* v) {
+    lvec* vec = vec_from_array(v->cell, v->count);
+    for (int i = 0; i < v->count; ++i) {
+        lval_del(v->cell[i]);
+    }
+    _lval_free_cells(v);
+    v->cell = NULL;
+    v->cap = 0;
+    v->vec = vec;
+    v->flags |= LVAL_VEC;
+}
+
+/* Returns a new reference to a vector holding the elements of v. */
+static lvec* _lval_vec_of(lval* v) {
+    if (v->flags & LVAL_VEC) {
+        return vec_retain(v->vec);
+    }
+    return vec_from_array(v->cell, v->count);
+}
+
+/* Returns a Q-expression holding the elements of vec, consuming vec.
+ * Short results go back to a plain array. */
+static lval* _lval_from_vec(lvec* vec) {
+    lval* ret = lval_qexpr();
+    ret->count = vec ? vec->count : 0;
+    if (ret->count >= LVAL_VEC_MIN) {
+        ret->cell = NULL;
+        ret->cap = 0;
+        ret->vec = vec;
+        ret->flags |= LVAL_VEC;
+        return ret;
+    }
+    _lval_alloc_cells(ret, ret->count);
+    vec_to_array(vec, ret->cell);
+    vec_release(vec);
+    return ret;
+}
+
+static void _lval_set_cap(lval* v, int cap) {
+    if (v->cell == _lval_inline_cells(v)) {
+        lval** cell = heap_alloc(HEAP_ARRAY, sizeof(lval*) * cap);
+        memcpy(cell, v->cell, sizeof(lval*) * v->count);
+        v->cell = cell;
+    } else {
+        v->cell = heap_realloc(HEAP_ARRAY, v->cell, sizeof(lval*) * v->cap,
+                               sizeof(lval*) * cap);
+    }
+    v->cap = cap;
+}
+
+/* Makes room for n more cells, for callers that know how many they are
+ * about to add. */
+void lval_reserve(lval* v, int n) {
+    assert( v->type == LVAL_SEXPR || v->type == LVAL_QEXPR);
+    assert( v->rc == 1 && !lval_is_view(v) );
+    if (!(v->flags & LVAL_VEC) && v->count + n > v->cap) {
+        _lval_set_cap(v, v->count + n);
+    }
+}
+
 void lval_add(lval* v, lval* x){
     assert( v->type == LVAL_SEXPR || v->type == LVAL_QEXPR);
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count - 1] = x;
+    assert( v->rc == 1 && !lval_is_view(v) && !(v->flags & LVAL_HCONS) );
+    if (v->flags & LVAL_VEC) {
+        lvec* t = vec_from_array(&x, 1);
+        lvec* vec = vec_concat(v->vec, t);
+        vec_release(t);
+        vec_release(v->vec);
+        lval_del(x);
+        v->vec = vec;
+        v->count++;
+        return;
+    }
+    if (v->count == v->cap) {
+        _lval_set_cap(v, v->cap ? 2 * v->cap : 4);
+    }
+    v->cell[v->count++] = x;
+    if (v->type == LVAL_QEXPR && v->count >= LVAL_VEC_MIN) {
+        _lval_to_vec(v);
+    }
+}
+
+/* Returns a borrowed pointer to the i-th element of a list. */
+lval* lval_item(lval* v, int i) {
+    assert( i >= 0 && i < v->count );
+    if (v->flags & LVAL_VEC) {
+        return vec_index(v->vec, i);
+    }
+    return v->cell[i];
+}
+
+/* Returns a view of count cells of v starting at start, consuming v. */
+lval* lval_slice(lval* v, int start, int count) {
+    assert( v->type == LVAL_QEXPR );
+    assert( start >= 0 && start + count <= v->count );
+    if (v->flags & LVAL_VEC) {
+        lval* ret = _lval_from_vec(vec_slice(v->vec, start, count));
+        lval_del(v);
+        return ret;
+    }
+    if (v->rc == 1 && v->base) {
+        v->cell += start;
+        v->count = count;
+        return v;
+    }
+    lval* ret = _lval_new(LVAL_QEXPR);
+    ret->cell = v->cell + start;
+    ret->count = count;
+    if (v->base) {
+        ret->base = lval_copy(v->base);
+        lval_del(v);
+    } else {
+        ret->base = v;
+    }
+    return ret;
+}
+
+/* Returns the elements of x followed by those of y, consuming both. */
+lval* lval_concat(lval* x, lval* y) {
+    assert( x->type == LVAL_QEXPR && y->type == LVAL_QEXPR );
+    if (x->count + y->count < LVAL_VEC_MIN) {
+        x = lval_unshare(x);
+        lval_reserve(x, y->count);
+        for (int i = 0; i < y->count; ++i) {
+            lval_add(x, lval_copy(lval_item(y, i)));
+        }
+        lval_del(y);
+        return x;
+    }
+    lvec* a = _lval_vec_of(x);
+    lvec* b = _lval_vec_of(y);
+    lval* ret = _lval_from_vec(vec_concat(a, b));
+    vec_release(a);
+    vec_release(b);
+    lval_del(x);
+    lval_del(y);
+    return ret;
+}
+
+void lval_retype(lval* v, int type) {
+    assert( v->rc == 1 && _lval_is_list(v->type) && _lval_is_list(type) );
+    lval_stats.types[v->type].live--;
+    lval_counter* c = &lval_stats.types[type];
+    if (++c->live > c->peak) {
+        c->peak = c->live;
+    }
+    v->type = type;
+}
+
+/* Gives v, which owns no cells, new references to the cells of src.
+ * src may be v itself. */
+static void _lval_copy_cells(lval* v, lval* src) {
+    lval** from = src->cell;
+    _lval_alloc_cells(v, src->count);
+    for (int i = 0; i < src->count; ++i) {
+        v->cell[i] = lval_copy(from[i]);
+    }
 }
 
 lval* lval_copy(lval* v) {
-    lval* ret = _lval_new();
+    if (!lval_is_fixnum(v) && !(v->flags & LVAL_RDONLY)) {
+        v->rc++;
+    }
+    return v;
+}
+
+lval* lval_unshare(lval* v) {
+    if (lval_is_fixnum(v)) {
+        return v;
+    }
+    if (v->rc == 1 && (v->flags & LVAL_HCONS)) {
+        hcons_forget(v);
+    }
+    if (v->type == LVAL_QEXPR && (v->flags & LVAL_VEC)) {
+        if (v->rc == 1) {
+            lvec* vec = v->vec;
+            lval_stats.copied_bytes += sizeof(lval*) * v->count;
+            v->base = NULL;
+            v->flags &= ~LVAL_VEC;
+            _lval_alloc_cells(v, v->count);
+            vec_to_array(vec, v->cell);
+            vec_release(vec);
+            return v;
+        }
+        lval* ret = lval_qexpr();
+        ret->count = v->count;
+        lval_stats.copied_bytes += sizeof(lval*) * v->count;
+        _lval_alloc_cells(ret, ret->count);
+        vec_to_array(v->vec, ret->cell);
+        v->rc--;
+        return ret;
+    }
+    int is_view = (v->type == LVAL_QEXPR || v->type == LVAL_SEXPR) &&
+        lval_is_view(v);
+    if (v->rc == 1 && is_view) {
+        lval* base = v->base;
+        lval_stats.copied_bytes += sizeof(lval*) * v->count;
+        _lval_copy_cells(v, v);
+        v->base = NULL;
+        lval_del(base);
+        return v;
+    }
+    if (v->rc == 1) {
+        return v;
+    }
+    lval* ret = _lval_new(v->type);
+    unsigned char flags = ret->flags;
     memcpy(ret, v, sizeof(lval));
+    ret->flags = flags;
+    ret->rc = 1;
+    if (!(v->flags & LVAL_RDONLY)) {
+        v->rc--;
+    }
+    lval_stats.copied_bytes += _lval_size(v->type);
 
     switch (v->type) {
     case LVAL_ERR:
-        ret->err = malloc(strlen(v->err) + 1);
-        strcpy(ret->err, v->err);
+        memcpy(_lval_err_args(ret), _lval_err_args(v),
+               sizeof(lval_err_arg) * LVAL_ERR_ARGS);
+        if (v->ref) {
+            ret->ref = lval_copy(v->ref);
+        }
+        break;
+    case LVAL_FLT:
         break;
     case LVAL_FUN:
-        if(!v->builtin) {
+        if(!lval_is_builtin(v)) {
             ret->env = lenv_copy(v->env);
             ret->formals = lval_copy(v->formals);
             ret->body = lval_copy(v->body);
         }
         break;
     case LVAL_NUM:
+        big_copy(&ret->big, &v->big);
+        lval_stats.copied_bytes += sizeof(uint32_t) * v->big.len;
         break;
     case LVAL_QEXPR:
     case LVAL_SEXPR:
-        ret->cell = malloc(sizeof(lval*) * v->count);
-        for (int i = 0; i < v->count; ++i) {
-            ret->cell[i] = lval_copy(v->cell[i]);
-        }
+        _lval_copy_cells(ret, v);
+        ret->base = NULL;
+        lval_stats.copied_bytes += sizeof(lval*) * v->count;
         break;
     case LVAL_STR:
-        ret->str = malloc(strlen(v->str) + 1);
-        strcpy(ret->sym, v->sym);
+        _lval_set_str(ret, v->str, v->len);
+        if (v->len >= LVAL_INLINE_STR) {
+            lval_stats.copied_bytes += v->len + 1;
+        }
+        break;
     case LVAL_SYM:
-        ret->sym = malloc(strlen(v->sym) + 1);
-        strcpy(ret->sym, v->sym);
         break;
     default:
         assert( 0 );
@@ -141,158 +617,541 @@ lval* lval_copy(lval* v) {
 }
 
 void lval_del(lval* v) {
+    if (lval_is_fixnum(v) || (v->flags & LVAL_RDONLY) || --v->rc > 0) {
+        return;
+    }
     switch (v->type) {
     case LVAL_ERR:
-        free(v->err);
+        if (v->ref) {
+            lval_del(v->ref);
+        }
+        break;
+    case LVAL_FLT:
         break;
     case LVAL_FUN:
-        if(!v->builtin) {
+        if(!lval_is_builtin(v)) {
             lenv_del(v->env);
             lval_del(v->formals);
             lval_del(v->body);
         }
         break;
     case LVAL_NUM:
+        big_free(&v->big);
         break;
     case LVAL_QEXPR:
     case LVAL_SEXPR:
+        if (v->flags & LVAL_HCONS) {
+            hcons_forget(v);
+        }
+        if (v->flags & LVAL_VEC) {
+            vec_release(v->vec);
+            break;
+        }
+        if (v->base) {
+            lval_del(v->base);
+            break;
+        }
         for (int i = 0; i < v->count; ++i) {
             lval_del(v->cell[i]);
         }
-        free(v->cell);
+        _lval_free_cells(v);
         break;
     case LVAL_STR:
-        free(v->str);
+        if (v->str != _lval_inline_str(v)) {
+            free(v->str);
+        }
         break;
     case LVAL_SYM:
-        free(v->sym);
         break;
     default:
         assert( 0 );
     }
-    free(v);
+    _lval_free(v);
 }
 
-void _lval_print_sexpr(lval* v, char open, char close) {
-    putchar(open);
-    if (v->count == 0) {
-        putchar(close);
+/* Output is built in one growable buffer. When it has a FILE, the
+ * buffer is written out in LVAL_PRINT_CHUNK pieces as it fills. */
+#define LVAL_PRINT_CHUNK (64 * 1024)
+
+typedef struct {
+    FILE* out;
+    char* data;
+    int len;
+    int cap;
+} lval_buf;
+
+static lval_buf _lval_print_buf;
+
+static void _lval_buf_reserve(lval_buf* b, int n) {
+    if (b->out && b->len > 0 && b->len + n > LVAL_PRINT_CHUNK) {
+        fwrite(b->data, 1, b->len, b->out);
+        b->len = 0;
+    }
+    if (b->len + n > b->cap) {
+        int cap = b->cap ? 2 * b->cap : 256;
+        while (cap < b->len + n) {
+            cap *= 2;
+        }
+        b->data = realloc(b->data, cap);
+        b->cap = cap;
+    }
+}
+
+static void _lval_buf_put(lval_buf* b, char* s, int n) {
+    _lval_buf_reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+static void _lval_buf_putc(lval_buf* b, char c) {
+    _lval_buf_reserve(b, 1);
+    b->data[b->len++] = c;
+}
+
+static void _lval_buf_puts(lval_buf* b, char* s) {
+    _lval_buf_put(b, s, strlen(s));
+}
+
+/* Writes s quoted, with the escapes the reader understands. */
+static void _lval_buf_escape(lval_buf* b, char* s, int len) {
+    _lval_buf_reserve(b, 2 * len + 2);
+    char* p = b->data + b->len;
+    *p++ = '"';
+    for (int i = 0; i < len; ++i) {
+        char e;
+        switch (s[i]) {
+        case '\a': e = 'a'; break;
+        case '\b': e = 'b'; break;
+        case '\f': e = 'f'; break;
+        case '\n': e = 'n'; break;
+        case '\r': e = 'r'; break;
+        case '\t': e = 't'; break;
+        case '\v': e = 'v'; break;
+        case '\\': e = '\\'; break;
+        case '\'': e = '\''; break;
+        case '"': e = '"'; break;
+        case '\0': e = '0'; break;
+        default:
+            *p++ = s[i];
+            continue;
+        }
+        *p++ = '\\';
+        *p++ = e;
+    }
+    *p++ = '"';
+    b->len = p - b->data;
+}
+
+static void _lval_buf_print(lval_buf* b, lval* v);
+
+static void _lval_buf_print_list(lval_buf* b, lval* v, char open, char close) {
+    _lval_buf_putc(b, open);
+    for (int i = 0; i < v->count; ++i) {
+        if (i > 0) {
+            _lval_buf_putc(b, ' ');
+        }
+        _lval_buf_print(b, lval_item(v, i));
+    }
+    _lval_buf_putc(b, close);
+}
+
+/* Prints a finite float in the shortest representation that reads back
+ * as the same float, with a ".0" if it would otherwise read as an
+ * integer. Infinities and NaN print as inf, -inf and nan, which the
+ * reader does not accept. */
+static void _lval_buf_print_flt(lval_buf* b, double x) {
+    if (isnan(x) || isinf(x)) {
+        _lval_buf_puts(b, isnan(x) ? "nan" : x < 0 ? "-inf" : "inf");
         return;
     }
-    for (int i = 0; i < v->count - 1; ++i) {
-        lval_print(v->cell[i]);
-        putchar(' ');
+    char buf[32];
+    for (int prec = 15; prec <= 17; ++prec) {
+        snprintf(buf, sizeof(buf), "%.*g", prec, x);
+        if (strtod(buf, NULL) == x) {
+            break;
+        }
     }
-    lval_print(v->cell[v->count - 1]);
-    putchar(close);
+    if (strspn(buf, "-0123456789") == strlen(buf)) {
+        strcat(buf, ".0");
+    }
+    _lval_buf_puts(b, buf);
 }
 
-void lval_print(lval* v) {
-    switch (v->type) {
+static void _lval_buf_print(lval_buf* b, lval* v) {
+    switch (lval_type(v)) {
     case LVAL_ERR:
-        printf("Error:\n  %s", v->err);
-        break;
+        {
+            char msg[512];
+            lval_err_message(v, msg, sizeof(msg));
+            _lval_buf_puts(b, "Error:\n  ");
+            _lval_buf_puts(b, msg);
+            break;
+        }
     case LVAL_FUN:
-        if(v->builtin) {
-            printf("<builtin>");
+        if(lval_is_builtin(v)) {
+            _lval_buf_puts(b, "<builtin>");
         } else {
-            printf("(\\");
-            lval_print(v->formals);
-            putchar(' ');
-            lval_print(v->body);
-            putchar(')');
+            _lval_buf_puts(b, "(\\");
+            _lval_buf_print(b, v->formals);
+            _lval_buf_putc(b, ' ');
+            _lval_buf_print(b, v->body);
+            _lval_buf_putc(b, ')');
         }
         break;
+    case LVAL_FLT:
+        _lval_buf_print_flt(b, v->flt);
+        break;
     case LVAL_NUM:
-        printf("%li", v->num);
+        if (lval_is_fixnum(v)) {
+            char buf[32];
+            _lval_buf_put(b, buf, snprintf(buf, sizeof(buf), "%li",
+                                           lval_num_value(v)));
+        } else {
+            char* digits = big_to_string(&v->big);
+            _lval_buf_puts(b, digits);
+            free(digits);
+        }
         break;
     case LVAL_QEXPR:
-        _lval_print_sexpr(v, '{', '}');
+        _lval_buf_print_list(b, v, '{', '}');
         break;
     case LVAL_SEXPR:
-        _lval_print_sexpr(v, '(', ')');
+        _lval_buf_print_list(b, v, '(', ')');
         break;
     case LVAL_STR:
-        {
-            char* escaped = malloc(strlen(v->str) + 1);
-            strcpy(escaped, v->str);
-            escaped = mpcf_escape(escaped);
-            printf("\"%s\"", escaped);
-            free(escaped);
-            break;
-        }
+        _lval_buf_escape(b, v->str, v->len);
+        break;
     case LVAL_SYM:
-        printf("%s", v->sym);
+        _lval_buf_puts(b, v->sym);
         break;
     default:
         assert( 0 );
     }
 }
 
+void lval_fprint(FILE* out, lval* v) {
+    lval_buf* b = &_lval_print_buf;
+    b->out = out;
+    b->len = 0;
+    _lval_buf_print(b, v);
+    fwrite(b->data, 1, b->len, out);
+    b->out = NULL;
+}
+
+void lval_print(lval* v) {
+    lval_fprint(stdout, v);
+}
+
 void lval_println(lval* v) {
     lval_print(v);
     putchar('\n');
 }
 
+lval* lval_show(lval* v) {
+    lval_buf* b = &_lval_print_buf;
+    b->len = 0;
+    _lval_buf_print(b, v);
+    lval* ret = _lval_new(LVAL_STR);
+    _lval_set_str(ret, b->data, b->len);
+    return ret;
+}
+
 lenv* lenv_new() {
-    lenv* ret = calloc(1, sizeof(lenv));
+    lenv* ret = heap_calloc(HEAP_LENV, sizeof(lenv));
+    ret->arena = _lval_in_arena;
     return ret;
 }
 
+lenv* lenv_new_global() {
+    lenv* ret = lenv_new();
+    ret->global = 1;
+    return ret;
+}
+
+static uint32_t _lenv_hash(char* sym) {
+    return (uint32_t)(((uintptr_t)sym >> 3) * 2654435761u);
+}
+
+static void _lenv_index_add(lenv* e, int i) {
+    uint32_t mask = e->index_cap - 1;
+    uint32_t j = _lenv_hash(e->syms[i]) & mask;
+    while (e->index[j]) {
+        j = (j + 1) & mask;
+    }
+    e->index[j] = i + 1;
+}
+
+/* Rebuilds the index of e with room for twice its bindings. */
+static void _lenv_reindex(lenv* e) {
+    heap_free(HEAP_ARRAY, e->index, sizeof(int) * e->index_cap);
+    int cap = 2 * LENV_HASH_MIN;
+    while (cap < 4 * e->count) {
+        cap *= 2;
+    }
+    e->index_cap = cap;
+    e->index = heap_calloc(HEAP_ARRAY, sizeof(int) * cap);
+    for (int i = 0; i < e->count; ++i) {
+        _lenv_index_add(e, i);
+    }
+}
+
+/* Returns the position of sym in e, or -1. */
+static int _lenv_find(lenv* e, char* sym) {
+    if (e->index) {
+        uint32_t mask = e->index_cap - 1;
+        for (uint32_t j = _lenv_hash(sym) & mask; e->index[j];
+             j = (j + 1) & mask) {
+            int i = e->index[j] - 1;
+            if (e->syms[i] == sym) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    for (int i = 0; i < e->count; ++i) {
+        if (e->syms[i] == sym) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 lenv* lenv_copy(lenv* e){
     lenv* ret = lenv_new();
     ret->parent = e->parent;
     ret->count = e->count;
-    ret->syms = malloc(sizeof(char*) * ret->count);
-    ret->vals = malloc(sizeof(lval*) * ret->count);
+    ret->syms = heap_alloc(HEAP_ARRAY, sizeof(char*) * ret->count);
+    ret->vals = heap_alloc(HEAP_ARRAY, sizeof(lval*) * ret->count);
+    lval_stats.env_copied_bytes +=
+        sizeof(lenv) + (sizeof(char*) + sizeof(lval*)) * ret->count;
     for (int i = 0; i < ret->count; ++i) {
-        ret->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(ret->syms[i], e->syms[i]);
+        ret->syms[i] = e->syms[i];
         ret->vals[i] = lval_copy(e->vals[i]);
+        _lval_cell(ret->syms[i])->binds++;
+    }
+    if (e->index) {
+        ret->index_cap = e->index_cap;
+        ret->index = heap_alloc(HEAP_ARRAY, sizeof(int) * e->index_cap);
+        memcpy(ret->index, e->index, sizeof(int) * e->index_cap);
+    } else if (ret->count > LENV_HASH_MIN) {
+        _lenv_reindex(ret);
     }
     return ret;
 }
 
 void lenv_del(lenv* e) {
     for (int i = 0; i < e->count; ++i) {
-        free(e->syms[i]);
+        lcell* c = _lval_cell(e->syms[i]);
+        c->binds--;
+        if (e->global) {
+            c->val = NULL;
+        }
         lval_del(e->vals[i]);
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    heap_free(HEAP_ARRAY, e->syms, sizeof(char*) * e->count);
+    heap_free(HEAP_ARRAY, e->vals, sizeof(lval*) * e->count);
+    heap_free(HEAP_ARRAY, e->index, sizeof(int) * e->index_cap);
+    heap_free(HEAP_LENV, e, sizeof(lenv));
     return;
 }
 
+static lval* _lenv_get(lenv* e, lval* k) {
+    int i = k->slot - 1;
+    if (i < 0 || i >= e->count || e->syms[i] != k->sym) {
+        i = _lenv_find(e, k->sym);
+    }
+    if (i >= 0) {
+        lval_stats.env_gets++;
+        return lval_copy(e->vals[i]);
+    }
+    if (e->parent) {
+        return _lenv_get(e->parent, k);
+    }
+    return lval_err("Unbound symbol %s!", k->sym);
+}
+
 lval* lenv_get(lenv* e, lval* k) {
     assert (k->type == LVAL_SYM);
-    for (int i = 0; i < e->count; ++i) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+    lcell* c = k->global ? k->global : _lval_cell(k->sym);
+    if (c->binds == 1 && c->val) {
+        lval_stats.env_gets++;
+        lval_stats.global_hits++;
+        return lval_copy(c->val);
+    }
+    return _lenv_get(e, k);
+}
+
+/* Whether v is, or holds, an LVAL_ARENA value. Interned lists, mapped
+ * values and environments made outside the arena never do. */
+static int _lval_has_arena(lval* v) {
+    if (lval_is_fixnum(v) || (v->flags & LVAL_RDONLY)) {
+        return 0;
+    }
+    if (v->flags & LVAL_ARENA) {
+        return 1;
+    }
+    switch (v->type) {
+    case LVAL_ERR:
+        return v->ref && _lval_has_arena(v->ref);
+    case LVAL_FUN:
+        return !lval_is_builtin(v) &&
+            (_lval_has_arena(v->formals) || _lval_has_arena(v->body));
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+        if (v->flags & LVAL_HCONS) {
+            return 0;
         }
+        for (int i = 0; i < v->count; ++i) {
+            if (_lval_has_arena(lval_item(v, i))) {
+                return 1;
+            }
+        }
+        return 0;
+    default:
+        return 0;
     }
-    if (e->parent) {
-        return lenv_get(e->parent, k);
+}
+
+static lval* _lval_promote(lval* v);
+
+static lenv* _lenv_promote(lenv* e) {
+    lenv* ret = lenv_copy(e);
+    for (int i = 0; i < ret->count; ++i) {
+        lval* x = _lval_promote(ret->vals[i]);
+        lval_del(ret->vals[i]);
+        ret->vals[i] = x;
+    }
+    return ret;
+}
+
+/* Returns a reference to v, copying whatever part of it lives in the
+ * arena. Must be called with the arena suspended. */
+static lval* _lval_promote(lval* v) {
+    if (!_lval_has_arena(v)) {
+        return lval_copy(v);
+    }
+    lval* ret;
+    switch (v->type) {
+    case LVAL_ERR:
+        {
+            char msg[512];
+            lval_err_message(v, msg, sizeof(msg));
+            return lval_err_str(lval_str(msg));
+        }
+    case LVAL_FLT:
+        return lval_flt(v->flt);
+    case LVAL_FUN:
+        if (lval_is_builtin(v)) {
+            return lval_builtin(v->builtin);
+        }
+        ret = _lval_new(LVAL_FUN);
+        ret->formals = _lval_promote(v->formals);
+        ret->body = _lval_promote(v->body);
+        ret->env = _lenv_promote(v->env);
+        return ret;
+    case LVAL_NUM:
+        {
+            bignum big;
+            big_copy(&big, &v->big);
+            return lval_num_big(&big);
+        }
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+        ret = v->type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+        lval_reserve(ret, v->count);
+        for (int i = 0; i < v->count; ++i) {
+            lval_add(ret, _lval_promote(lval_item(v, i)));
+        }
+        return ret;
+    case LVAL_STR:
+        ret = _lval_new(LVAL_STR);
+        _lval_set_str(ret, v->str, v->len);
+        return ret;
+    case LVAL_SYM:
+        ret = lval_sym(v->sym);
+        ret->slot = v->slot;
+        return ret;
+    default:
+        assert( 0 );
     }
-    return lval_err("Unbound symbol %s!", k->sym);
+}
+
+void lval_print_stats(FILE* out) {
+    fprintf(out, "%-12s %10s %10s %10s %10s\n",
+            "type", "allocs", "frees", "live", "peak");
+    for (int i = 0; i < LVAL_NTYPES; ++i) {
+        lval_counter* c = &lval_stats.types[i];
+        fprintf(out, "%-12s %10li %10li %10li %10li\n", lval_type_name(i),
+                c->allocs, c->frees, c->live, c->peak);
+    }
+    fprintf(out, "copied: %li bytes by lval_unshare, %li by lenv_copy\n",
+            lval_stats.copied_bytes, lval_stats.env_copied_bytes);
+    fprintf(out, "lenv_get: %li references, %li from global cells\n",
+            lval_stats.env_gets, lval_stats.global_hits);
+}
+
+static lval* _lval_stats_pair(char* name, long n) {
+    lval* ret = lval_qexpr();
+    lval_add(ret, lval_str(name));
+    lval_add(ret, lval_num(n));
+    return ret;
+}
+
+lval* lval_stats_list(void) {
+    lval* ret = lval_qexpr();
+    for (int i = 0; i < LVAL_NTYPES; ++i) {
+        lval_counter* c = &lval_stats.types[i];
+        lval* x = lval_qexpr();
+        lval_add(x, lval_str(lval_type_name(i)));
+        lval_add(x, lval_num(c->allocs));
+        lval_add(x, lval_num(c->frees));
+        lval_add(x, lval_num(c->live));
+        lval_add(x, lval_num(c->peak));
+        lval_add(ret, x);
+    }
+    lval_add(ret, _lval_stats_pair("copied", lval_stats.copied_bytes));
+    lval_add(ret, _lval_stats_pair("env-copied",
+                                   lval_stats.env_copied_bytes));
+    lval_add(ret, _lval_stats_pair("env-gets", lval_stats.env_gets));
+    lval_add(ret, _lval_stats_pair("global-hits", lval_stats.global_hits));
+    return ret;
 }
 
 void lenv_put(lenv*e, lval* k, lval* v) {
     assert (k->type == LVAL_SYM);
-    for (int i = 0; i < e->count; ++i) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+    if (_lval_in_arena && !e->arena) {
+        _lval_in_arena = 0;
+        v = _lval_promote(v);
+        _lval_in_arena = 1;
+    } else {
+        v = lval_copy(v);
     }
+    lcell* c = _lval_cell(k->sym);
+    if (e->global) {
+        c->val = v;
+    }
+    int i = _lenv_find(e, k->sym);
+    if (i >= 0) {
+        lval_del(e->vals[i]);
+        e->vals[i] = v;
+        return;
+    }
+    c->binds++;
     e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+    e->vals = heap_realloc(HEAP_ARRAY, e->vals, sizeof(lval*) * (e->count - 1),
+                           sizeof(lval*) * e->count);
+    e->syms = heap_realloc(HEAP_ARRAY, e->syms, sizeof(char*) * (e->count - 1),
+                           sizeof(char*) * e->count);
 
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+    e->vals[e->count - 1] = v;
+    e->syms[e->count - 1] = k->sym;
+    if (2 * e->count > e->index_cap) {
+        if (e->count > LENV_HASH_MIN) {
+            _lenv_reindex(e);
+        }
+    } else {
+        _lenv_index_add(e, e->count - 1);
+    }
 }
 
 void lenv_def(lenv*e, lval* k, lval* v) {
@@ -1,65 +1,264 @@
 #ifndef LVAL_H
 #define LVAL_H
 
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bignum.h"
+
 struct lval;
+struct lcell;
 struct lenv;
+struct lvec;
 typedef struct lval lval;
 typedef struct lenv lenv;
 
 typedef lval* (*lbuiltin)(lenv*, lval*);
 
 enum { LVAL_ERR,
+       LVAL_FLT,
        LVAL_FUN,
        LVAL_NUM,
        LVAL_QEXPR,
        LVAL_SEXPR,
        LVAL_STR,
-       LVAL_SYM };
+       LVAL_SYM,
+       LVAL_NTYPES };
 
+/* Only the fields of the variant selected by `type` are meaningful.
+ * A function is a builtin iff it has no formals; `builtin` and `env`
+ * share storage.
+ *
+ * Values are reference counted and shared: lval_copy takes another
+ * reference and lval_del drops one. A value with rc > 1 must not be
+ * modified; call lval_unshare first to get a private copy. */
 struct lval {
-    int type;
+    unsigned char type;
+    unsigned char flags;
+    int rc;
 
-    long num;
+    union {
+        /* LVAL_ERR. The message is `fmt` formatted with arguments
+         * captured right after the lval; it is only built when needed,
+         * by lval_err_message. `ref` keeps alive a string value that
+         * an argument points into. */
+        struct {
+            char* fmt;
+            struct lval* ref;
+        };
 
-    int count;
-    struct lval** cell;
+        /* LVAL_FLT */
+        double flt;
+
+        /* LVAL_FUN */
+        struct {
+            union {
+                lbuiltin builtin;
+                lenv* env;
+            };
+            lval* formals;
+            lval* body;
+        };
+
+        /* LVAL_NUM, for numbers outside the fixnum range */
+        bignum big;
 
-    lbuiltin builtin;
-    lenv* env;
-    lval* formals;
-    lval* body;
+        /* LVAL_QEXPR, LVAL_SEXPR. A list with a `base` is a view: its
+         * cells are a window into base's array, which holds the
+         * references, so a slice costs O(1). Only Q-expressions are
+         * ever views; lval_unshare turns a view back into a list that
+         * owns its cells.
+         *
+         * A Q-expression with LVAL_VEC set keeps its elements in the
+         * persistent vector `vec` instead, and `cell` is NULL. Lists
+         * switch to it once they reach LVAL_VEC_MIN elements, so that
+         * join, head and tail stay O(log n) however long they grow.
+         * Read elements with lval_item; lval_unshare turns a vector
+         * back into an array.
+         *
+         * `cap` is the number of slots allocated for `cell`; it is 0
+         * for views and vectors, which own no array. Lists are
+         * allocated with room for LVAL_INLINE_CELLS cells right after
+         * the lval, and `cell` points there until the list outgrows
+         * it, so short lists need no separate array. */
+        struct {
+            int count;
+            int cap;
+            struct lval** cell;
+            union {
+                struct lval* base;
+                struct lvec* vec;
+            };
+        };
 
-    char* str;
-    char* sym;
-    char* err;
+        /* LVAL_STR. `len` excludes the terminating NUL. Strings
+         * shorter than LVAL_INLINE_STR bytes are stored right after
+         * the lval instead of in a separate allocation. */
+        struct {
+            char* str;
+            int len;
+        };
+
+        /* LVAL_SYM, interned by symtab_intern. A non-zero `slot` is
+         * a hint set by lval_lambda: the symbol names a formal, bound
+         * at index slot - 1 of the call frame. `global` caches the
+         * symbol's lcell, or is NULL in mapped images. */
+        struct {
+            char* sym;
+            int slot;
+            struct lcell* global;
+        };
+    };
 };
 
+/* lval.flags */
+#define LVAL_VEC        0x10
+#define LVAL_HCONS      0x20
+#define LVAL_ARENA      0x40
+/* Lives in a read-only mapped image: never written to, so lval_copy and
+ * lval_del leave its reference count alone and lval_unshare always
+ * copies it. */
+#define LVAL_RDONLY     0x80
+
+#define LVAL_VEC_MIN 64
+#define LVAL_INLINE_CELLS 4
+#define LVAL_INLINE_STR 16
+#define LVAL_ERR_ARGS 4
+
+/* Numbers in [LVAL_FIXNUM_MIN, LVAL_FIXNUM_MAX] are not allocated: the
+ * value is stored in the lval* itself, shifted left with the low bit set.
+ * Such a "fixnum" must never be dereferenced, so code that may see a
+ * number uses lval_type instead of ->type, and lval_num_value only
+ * after checking lval_is_fixnum. lval_copy and lval_del treat fixnums
+ * as plain words.
+ *
+ * Every other integer is a boxed bignum. Numbers are kept normalized,
+ * so a number is a fixnum exactly when its value fits in one. */
+#define LVAL_FIXNUM_MIN (INTPTR_MIN >> 1)
+#define LVAL_FIXNUM_MAX (INTPTR_MAX >> 1)
+
+static inline int lval_is_fixnum(lval* v) {
+    return ((uintptr_t)v & 1) != 0;
+}
+
+static inline int lval_type(lval* v) {
+    return lval_is_fixnum(v) ? LVAL_NUM : v->type;
+}
+
+static inline long lval_num_value(lval* v) {
+    return (long)((intptr_t)v >> 1);
+}
+
 char* lval_type_name(int type);
 
-lval* lval_err(char *err, ...);
+/* fmt must outlive the error, and so must its %s arguments: pass
+ * string literals, type names or interned symbols. Only %s, %i, %d and
+ * their l-prefixed forms are supported. */
+lval* lval_err(char *fmt, ...);
+/* An error whose message is the string value str, which is consumed. */
+lval* lval_err_str(lval* str);
 lval* lval_builtin(lbuiltin builtin);
+lval* lval_flt(double flt);
 lval* lval_lambda(lval* formals, lval* body);
 lval* lval_num(long num);
+lval* lval_num_big(bignum* big);
 lval* lval_qexpr(void);
 lval* lval_sexpr(void);
 lval* lval_str(char* str);
 lval* lval_sym(char* sym);
 
+int lval_is_builtin(lval* v);
+int lval_is_view(lval* v);
+
 void lval_add(lval* v, lval* x);
+void lval_reserve(lval* v, int n);
+lval* lval_item(lval* v, int i);
+lval* lval_slice(lval* v, int start, int count);
+lval* lval_concat(lval* x, lval* y);
+/* Turns an unshared list into a Q- or S-expression. */
+void lval_retype(lval* v, int type);
 
 lval* lval_copy(lval* v);
+lval* lval_unshare(lval* v);
 void lval_del(lval* v);
+void lval_err_message(lval* v, char* buf, int size);
+/* The printers format into a reused buffer and write it out in large
+ * chunks. lval_show returns the printed form as a string value. */
+void lval_fprint(FILE* out, lval* v);
 void lval_print(lval* v);
 void lval_println(lval* v);
+lval* lval_show(lval* v);
+
+/* With lval_arena set, lvals made between lval_arena_begin and the
+ * matching lval_arena_end come from the heap arena and are marked
+ * LVAL_ARENA. Reference counting still runs, but their memory is
+ * reclaimed all at once by the outermost lval_arena_end, so none may
+ * outlive it. lenv_put copies a value out of the arena when it is
+ * stored in an environment made outside of it. */
+extern int lval_arena;
+void lval_arena_begin(void);
+void lval_arena_end(void);
+
+/* Always-on counters, indexed by type. Fixnums are never allocated and
+ * are not counted. A list retyped by lval_retype is freed, and counted
+ * live, as its new type. lenv_get hands out references rather than copies,
+ * so it is measured in references. */
+typedef struct {
+    long allocs;
+    long frees;
+    long live;
+    long peak;
+} lval_counter;
+
+typedef struct {
+    lval_counter types[LVAL_NTYPES];
+    long copied_bytes;
+    long env_copied_bytes;
+    long env_gets;
+    long global_hits;
+} lval_stats_t;
+
+extern lval_stats_t lval_stats;
+void lval_print_stats(FILE* out);
+/* The counters as a Q-expression: a {type allocs frees live peak} entry
+ * per type, then {name count} pairs for copied, env-copied, env-gets
+ * and global-hits. */
+lval* lval_stats_list(void);
+
+/* `syms` holds interned symbol names, so lookups compare pointers.
+ * Past LENV_HASH_MIN bindings they also go through `index`, an
+ * open-addressing table of positions in `syms` plus one, with 0 for an
+ * empty slot. An environment without one is searched linearly. */
+#define LENV_HASH_MIN 16
 
 struct lenv {
     lenv* parent;
     int count;
     char** syms;
     lval** vals;
+    int* index;
+    int index_cap;
+    /* Made inside an arena, so it dies with it. Environments made
+     * outside never hold LVAL_ARENA values. */
+    int arena;
+    /* Made by lenv_new_global: its bindings are kept in lcells. */
+    int global;
 };
 
+/* Every symbol has a cell, which symbol lvals cache. `binds` counts the
+ * live bindings of the symbol in all environments, and `val` is its
+ * binding in the global environment, or NULL. When the global binding is
+ * the only one, every lookup ends there, so lenv_get returns it at once.
+ * lenv_put updates the cell in place, so redefinitions are seen. This
+ * relies on every evaluation chain ending at the global environment. */
+typedef struct lcell {
+    lval* val;
+    int binds;
+} lcell;
+
 lenv* lenv_new(void);
+/* There should be at most one global environment. */
+lenv* lenv_new_global(void);
 lenv* lenv_copy(lenv* e);
 void lenv_del(lenv* e);
 
@@ -1,10 +1,11 @@
 #include "assert.h"
 
+#include "hcons.h"
 #include "parser.h"
 
 
 char * grammar ="                              \
-number   : /-?[0-9]+/ ;                        \
+number   : /-?[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?/ ; \
 string   : /\"(\\\\.|[^\"])*\"/ ;              \
 symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&:]+/ ; \
 comment  : /;[^\\r\\n]*/ ;                     \
@@ -16,6 +17,9 @@ lispy    : /^/ <expr>* /$/ ;                   \
 ";
 
 void init_parser() {
+    if (Lispy) {
+        return;
+    }
     Number   = mpc_new("number");
     String   = mpc_new("string");
     Symbol   = mpc_new("symbol");
@@ -30,14 +34,28 @@ void init_parser() {
 }
 
 void tear_down_parser() {
+    if (!Lispy) {
+        return;
+    }
     mpc_cleanup(8, Number, String, Symbol, Comment, Sexpr, Qexpr, Expr, Lispy);
+    Lispy = NULL;
 }
 
 lval* lval_read(mpc_ast_t* t) {
     if (strstr(t->tag, "number")) {
+        if (strpbrk(t->contents, ".eE")) {
+            return lval_flt(strtod(t->contents, NULL));
+        }
         errno = 0;
         long x = strtol(t->contents, NULL, 10);
-        return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+        if (errno != ERANGE) {
+            return lval_num(x);
+        }
+        bignum big;
+        if (!big_from_string(&big, t->contents)) {
+            return lval_err("invalid number");
+        }
+        return lval_num_big(&big);
     }
     if (strstr(t->tag, "symbol")) {
         return lval_sym(t->contents);
@@ -57,13 +75,14 @@ lval* lval_read(mpc_ast_t* t) {
         strstr(t->tag, "qexpr"))
     {
         lval* ret = strstr(t->tag, "qexpr") ? lval_qexpr() : lval_sexpr();
+        lval_reserve(ret, t->children_num - 2);
         for(int i = 1; i < t->children_num - 1; ++i) {
             if (strstr(t->children[i]->tag, "comment")) {
                 continue;
             }
             lval_add(ret, lval_read(t->children[i]));
         }
-        return ret;
+        return strcmp(t->tag, ">") == 0 ? ret : hcons_intern(ret);
     }
     assert( 0 );
 }
@@ -13,6 +13,7 @@ mpc_parser_t* Qexpr;
 mpc_parser_t* Expr;
 mpc_parser_t* Lispy;
 
+/* Compiles the grammar on first use; later calls do nothing. */
 void init_parser();
 
 void tear_down_parser();
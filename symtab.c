@@ -0,0 +1,82 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "symtab.h"
+
+/* Names are stored right after their data word. */
+typedef struct {
+    void* data;
+    char name[];
+} symtab_entry;
+
+static symtab_entry* _symtab_entry(char* name) {
+    return (symtab_entry*)(name - offsetof(symtab_entry, name));
+}
+
+static struct {
+    int count;
+    int capacity;
+    char** slots;
+} symtab;
+
+static uint32_t _symtab_hash(char* name) {
+    uint32_t h = 2166136261u;
+    for (; *name; ++name) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+static char** _symtab_slot(char** slots, int capacity, char* name) {
+    uint32_t i = _symtab_hash(name) & (capacity - 1);
+    while (slots[i] && strcmp(slots[i], name) != 0) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
+
+static void _symtab_grow(void) {
+    int capacity = symtab.capacity ? symtab.capacity * 2 : 256;
+    char** slots = calloc(capacity, sizeof(char*));
+    for (int i = 0; i < symtab.capacity; ++i) {
+        if (symtab.slots[i]) {
+            *_symtab_slot(slots, capacity, symtab.slots[i]) = symtab.slots[i];
+        }
+    }
+    free(symtab.slots);
+    symtab.slots = slots;
+    symtab.capacity = capacity;
+}
+
+char* symtab_intern(char* name) {
+    if (2 * (symtab.count + 1) > symtab.capacity) {
+        _symtab_grow();
+    }
+    char** slot = _symtab_slot(symtab.slots, symtab.capacity, name);
+    if (!*slot) {
+        symtab_entry* x = malloc(sizeof(symtab_entry) + strlen(name) + 1);
+        x->data = NULL;
+        strcpy(x->name, name);
+        *slot = x->name;
+        symtab.count++;
+    }
+    return *slot;
+}
+
+void** symtab_data(char* sym) {
+    return &_symtab_entry(sym)->data;
+}
+
+void symtab_tear_down(void) {
+    for (int i = 0; i < symtab.capacity; ++i) {
+        if (symtab.slots[i]) {
+            symtab_entry* x = _symtab_entry(symtab.slots[i]);
+            free(x->data);
+            free(x);
+        }
+    }
+    free(symtab.slots);
+    memset(&symtab, 0, sizeof(symtab));
+}
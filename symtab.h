@@ -0,0 +1,14 @@
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+/* Global symbol table. symtab_intern returns the unique copy of `name`,
+ * so interned symbols are compared by pointer. The returned strings
+ * live until symtab_tear_down and must not be freed or modified. */
+
+char* symtab_intern(char* name);
+/* A word of caller data kept with each interned symbol, NULL until set.
+ * symtab_tear_down frees it with free(). */
+void** symtab_data(char* sym);
+void symtab_tear_down(void);
+
+#endif
@@ -0,0 +1,248 @@
+#include <assert.h>
+
+#include "heap.h"
+#include "lval.h"
+#include "vec.h"
+
+static int _vec_is_leaf(lvec* v) {
+    return v->height == 0;
+}
+
+static size_t _vec_size(lvec* v) {
+    return sizeof(lvec) + (_vec_is_leaf(v) ? sizeof(lval*) * v->count : 0);
+}
+
+lvec* vec_retain(lvec* v) {
+    if (v) {
+        v->rc++;
+    }
+    return v;
+}
+
+void vec_release(lvec* v) {
+    if (!v || --v->rc > 0) {
+        return;
+    }
+    if (_vec_is_leaf(v)) {
+        for (int i = 0; i < v->count; ++i) {
+            lval_del(v->items[i]);
+        }
+    } else {
+        vec_release(v->left);
+        vec_release(v->right);
+    }
+    heap_free(HEAP_VEC, v, _vec_size(v));
+}
+
+/* Builds a leaf from the concatenation of two item ranges. */
+static lvec* _vec_leaf(lval** a, int na, lval** b, int nb) {
+    assert( na + nb > 0 && na + nb <= VEC_LEAF_MAX );
+    lvec* ret = heap_alloc(HEAP_VEC, sizeof(lvec) + sizeof(lval*) * (na + nb));
+    ret->rc = 1;
+    ret->count = na + nb;
+    ret->height = 0;
+    ret->left = ret->right = NULL;
+    for (int i = 0; i < na; ++i) {
+        ret->items[i] = lval_copy(a[i]);
+    }
+    for (int i = 0; i < nb; ++i) {
+        ret->items[na + i] = lval_copy(b[i]);
+    }
+    return ret;
+}
+
+static lvec* _vec_node(lvec* l, lvec* r) {
+    lvec* ret = heap_alloc(HEAP_VEC, sizeof(lvec));
+    ret->rc = 1;
+    ret->count = l->count + r->count;
+    ret->height = 1 + (l->height > r->height ? l->height : r->height);
+    ret->left = vec_retain(l);
+    ret->right = vec_retain(r);
+    return ret;
+}
+
+/* Joins two non-empty trees whose heights differ by at most one,
+ * merging small leaves so that appending one element at a time does
+ * not leave a trail of one-element leaves. */
+static lvec* _vec_pair(lvec* l, lvec* r) {
+    if (_vec_is_leaf(l) && _vec_is_leaf(r) &&
+        l->count + r->count <= VEC_LEAF_MAX) {
+        return _vec_leaf(l->items, l->count, r->items, r->count);
+    }
+    if (l->height == 1 && _vec_is_leaf(r) &&
+        l->right->count + r->count <= VEC_LEAF_MAX) {
+        lvec* m = _vec_leaf(l->right->items, l->right->count,
+                            r->items, r->count);
+        lvec* ret = _vec_node(l->left, m);
+        vec_release(m);
+        return ret;
+    }
+    if (r->height == 1 && _vec_is_leaf(l) &&
+        l->count + r->left->count <= VEC_LEAF_MAX) {
+        lvec* m = _vec_leaf(l->items, l->count,
+                            r->left->items, r->left->count);
+        lvec* ret = _vec_node(m, r->right);
+        vec_release(m);
+        return ret;
+    }
+    return _vec_node(l, r);
+}
+
+/* Joins two non-empty trees whose heights differ by at most two,
+ * rotating once if needed to restore balance. */
+static lvec* _vec_balance(lvec* l, lvec* r) {
+    lvec* a;
+    lvec* b;
+    lvec* ret;
+    if (l->height > r->height + 1) {
+        if (l->left->height >= l->right->height) {
+            a = _vec_pair(l->right, r);
+            ret = _vec_pair(l->left, a);
+            vec_release(a);
+        } else {
+            a = _vec_pair(l->left, l->right->left);
+            b = _vec_pair(l->right->right, r);
+            ret = _vec_pair(a, b);
+            vec_release(a);
+            vec_release(b);
+        }
+        return ret;
+    }
+    if (r->height > l->height + 1) {
+        if (r->right->height >= r->left->height) {
+            a = _vec_pair(l, r->left);
+            ret = _vec_pair(a, r->right);
+            vec_release(a);
+        } else {
+            a = _vec_pair(l, r->left->left);
+            b = _vec_pair(r->left->right, r->right);
+            ret = _vec_pair(a, b);
+            vec_release(a);
+            vec_release(b);
+        }
+        return ret;
+    }
+    return _vec_pair(l, r);
+}
+
+lvec* vec_concat(lvec* l, lvec* r) {
+    if (!l) {
+        return vec_retain(r);
+    }
+    if (!r) {
+        return vec_retain(l);
+    }
+    lvec* t;
+    lvec* ret;
+    if (l->height > r->height + 1) {
+        t = vec_concat(l->right, r);
+        ret = _vec_balance(l->left, t);
+    } else if (r->height > l->height + 1) {
+        t = vec_concat(l, r->left);
+        ret = _vec_balance(t, r->right);
+    } else {
+        return _vec_pair(l, r);
+    }
+    vec_release(t);
+    return ret;
+}
+
+/* Splits v into its first i elements and the rest. */
+static void _vec_split(lvec* v, int i, lvec** l, lvec** r) {
+    if (i == 0) {
+        *l = NULL;
+        *r = vec_retain(v);
+        return;
+    }
+    if (i == v->count) {
+        *l = vec_retain(v);
+        *r = NULL;
+        return;
+    }
+    if (_vec_is_leaf(v)) {
+        *l = _vec_leaf(v->items, i, NULL, 0);
+        *r = _vec_leaf(v->items + i, v->count - i, NULL, 0);
+        return;
+    }
+    lvec* t;
+    if (i <= v->left->count) {
+        _vec_split(v->left, i, l, &t);
+        *r = vec_concat(t, v->right);
+    } else {
+        _vec_split(v->right, i - v->left->count, &t, r);
+        *l = vec_concat(v->left, t);
+    }
+    vec_release(t);
+}
+
+lvec* vec_slice(lvec* v, int start, int count) {
+    assert( start >= 0 && count >= 0 && start + count <= (v ? v->count : 0) );
+    lvec* head;
+    lvec* rest;
+    lvec* ret;
+    lvec* tail;
+    _vec_split(v, start, &head, &rest);
+    _vec_split(rest, count, &ret, &tail);
+    vec_release(head);
+    vec_release(rest);
+    vec_release(tail);
+    return ret;
+}
+
+static lvec* _vec_build(lvec** leaves, int n) {
+    if (n == 1) {
+        return vec_retain(leaves[0]);
+    }
+    lvec* l = _vec_build(leaves, n / 2);
+    lvec* r = _vec_build(leaves + n / 2, n - n / 2);
+    lvec* ret = _vec_node(l, r);
+    vec_release(l);
+    vec_release(r);
+    return ret;
+}
+
+lvec* vec_from_array(lval** items, int count) {
+    if (count == 0) {
+        return NULL;
+    }
+    int n = (count + VEC_LEAF_MAX - 1) / VEC_LEAF_MAX;
+    lvec** leaves = heap_alloc(HEAP_ARRAY, sizeof(lvec*) * n);
+    for (int i = 0; i < n; ++i) {
+        int start = i * VEC_LEAF_MAX;
+        int len = count - start < VEC_LEAF_MAX ? count - start : VEC_LEAF_MAX;
+        leaves[i] = _vec_leaf(items + start, len, NULL, 0);
+    }
+    lvec* ret = _vec_build(leaves, n);
+    for (int i = 0; i < n; ++i) {
+        vec_release(leaves[i]);
+    }
+    heap_free(HEAP_ARRAY, leaves, sizeof(lvec*) * n);
+    return ret;
+}
+
+lval* vec_index(lvec* v, int i) {
+    assert( i >= 0 && i < v->count );
+    while (!_vec_is_leaf(v)) {
+        if (i < v->left->count) {
+            v = v->left;
+        } else {
+            i -= v->left->count;
+            v = v->right;
+        }
+    }
+    return v->items[i];
+}
+
+void vec_to_array(lvec* v, lval** out) {
+    if (!v) {
+        return;
+    }
+    if (_vec_is_leaf(v)) {
+        for (int i = 0; i < v->count; ++i) {
+            out[i] = lval_copy(v->items[i]);
+        }
+        return;
+    }
+    vec_to_array(v->left, out);
+    vec_to_array(v->right, out + v->left->count);
+}
@@ -0,0 +1,40 @@
+#ifndef VEC_H
+#define VEC_H
+
+struct lval;
+
+/* Persistent vector backing for large Q-expressions.
+ *
+ * A height-balanced concatenation tree whose leaves hold up to
+ * VEC_LEAF_MAX element pointers. Nodes are immutable and reference
+ * counted, so trees share structure freely: concatenation, split,
+ * slicing and appending build O(log n) new nodes and leave their
+ * arguments intact, and indexing walks one root-to-leaf path.
+ *
+ * The empty vector is NULL. Unless noted otherwise, functions borrow
+ * their arguments and return a new reference. */
+
+#define VEC_LEAF_MAX 32
+
+typedef struct lvec {
+    int rc;
+    int count;
+    int height;
+    struct lvec* left;
+    struct lvec* right;
+    struct lval* items[];
+} lvec;
+
+lvec* vec_from_array(struct lval** items, int count);
+lvec* vec_concat(lvec* a, lvec* b);
+lvec* vec_slice(lvec* v, int start, int count);
+
+/* Returns a borrowed pointer to element i. */
+struct lval* vec_index(lvec* v, int i);
+/* Stores a new reference to every element into out. */
+void vec_to_array(lvec* v, struct lval** out);
+
+lvec* vec_retain(lvec* v);
+void vec_release(lvec* v);
+
+#endif